@@ -0,0 +1,288 @@
+// bench.cpp : Google Benchmark suite for the path a pose takes from the
+// phone's bytes to TrackedDevicePoseUpdated.
+//
+// vrdriver_bench [--benchmark_filter=Decode] [--benchmark_repetitions=5]
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "../../Driver/headers/ShareMem.h"
+#include "../../Driver/headers/WireFormat.h"
+#include "../../Driver/headers/Ingest.h"
+#include "../../Driver/headers/PoseMath.h"
+#include "../../Driver/headers/PoseFrame.h"
+
+// What a phone sends, with the digits a phone prints.
+static const char kPoseJson[] =
+	"{\"id\":0,\"seq\":1042,\"timestamp\":1700000000.123456,"
+	"\"translation\":[0.1234567890123456,-0.2345678901234567,0.0345678901234567],"
+	"\"rotation\":[12.345678901234567,-45.67890123456789,178.9012345678901],"
+	"\"trackpad\":[0.25,-0.5],\"clicked\":false,\"trigger\":0.75}";
+
+static std::string PoseJson(uint32_t id)
+{
+	std::string json = kPoseJson;
+	json[6] = (char)('0' + id);
+	return json;
+}
+
+// A layout in this process, set up like the driver's ingest mode sets up
+// its own: the ring and slots behave exactly as in the shared mapping.
+struct BenchLayout
+{
+	std::unique_ptr<SharedLayout> layout;
+	int slots[2];
+	PosePublisher publisher;
+
+	BenchLayout() : layout(new SharedLayout())
+	{
+		InitSharedLayout(layout.get());
+		for (uint32_t i = 0; i < 2; i++)
+		{
+			slots[i] = FindDeviceSlot(layout.get(), DeviceClass_Controller, i);
+		}
+		publisher.attach(layout.get());
+	}
+};
+
+// Stands in for vrserver: computes the controller poses the way
+// GetPose does and keeps them.
+struct BenchHost : PoseFrameHost
+{
+	ControllerState *controllers[2];
+	PoseResult poses[2];
+	double headPosition[3] = { 0.0, 1.6, 0.0 };
+	uint64_t updates = 0;
+
+	void submit_poses() override
+	{
+		uint64_t now = GetTimestampUs();
+		for (int index = 0; index < 2; index++)
+		{
+			controllers[index]->pose(index, 0.0, headPosition, now, poses[index]);
+			updates++;
+		}
+	}
+};
+
+//----------decode-----------
+
+static void BM_DecodeJson(benchmark::State &state)
+{
+	PosePacket packet;
+	uint32_t phoneSequence;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(DecodePosePacket(kPoseJson, sizeof(kPoseJson) - 1, packet, &phoneSequence));
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * (int64_t)(sizeof(kPoseJson) - 1));
+}
+BENCHMARK(BM_DecodeJson);
+
+// The DOM the driver used to build for every message, for comparison.
+static void BM_DecodeJsonDom(benchmark::State &state)
+{
+	const char *text = kPoseJson;
+	for (auto _ : state)
+	{
+		picojson::value json;
+		std::string err;
+		picojson::parse(json, text, text + sizeof(kPoseJson) - 1, &err);
+		benchmark::DoNotOptimize(json);
+	}
+	state.SetBytesProcessed(state.iterations() * (int64_t)(sizeof(kPoseJson) - 1));
+}
+BENCHMARK(BM_DecodeJsonDom);
+
+static void BM_DecodeWire(benchmark::State &state)
+{
+	WireConfig config;
+	PosePacket source = {};
+	uint32_t phoneSequence = 0;
+	DecodePosePacket(kPoseJson, sizeof(kPoseJson) - 1, source, &phoneSequence);
+	uint8_t wire[kWirePacketSize];
+	EncodeWirePacket(source, phoneSequence, config, wire);
+
+	PosePacket packet;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(DecodeWirePacket((const char *)wire, sizeof(wire), config, packet, &phoneSequence));
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_DecodeWire);
+
+// Number conversion alone, on the numbers of kPoseJson.
+static std::vector<std::string> PoseNumbers()
+{
+	std::vector<std::string> numbers;
+	const char *p = kPoseJson, *end = kPoseJson + sizeof(kPoseJson) - 1;
+	while (p < end)
+	{
+		if (('0' <= *p && *p <= '9') || *p == '-')
+		{
+			const char *last = ScanNumberChars(p, end);
+			numbers.push_back(std::string(p, last));
+			p = last;
+		}
+		else
+		{
+			p++;
+		}
+	}
+	return numbers;
+}
+
+static void BM_NumberFast(benchmark::State &state)
+{
+	std::vector<std::string> numbers = PoseNumbers();
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < numbers.size(); i++)
+		{
+			double value = 0.0;
+			benchmark::DoNotOptimize(ParseNumberFast(numbers[i].data(), numbers[i].size(), value));
+			benchmark::DoNotOptimize(value);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * (int64_t)numbers.size());
+}
+BENCHMARK(BM_NumberFast);
+
+static void BM_NumberStrtod(benchmark::State &state)
+{
+	std::vector<std::string> numbers = PoseNumbers();
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < numbers.size(); i++)
+		{
+			double value = 0.0;
+			benchmark::DoNotOptimize(JsonParseNumberStrtod(numbers[i].data(), numbers[i].size(), value));
+			benchmark::DoNotOptimize(value);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * (int64_t)numbers.size());
+}
+BENCHMARK(BM_NumberStrtod);
+
+//----------pose math-----------
+
+// GetPose of one controller after a new sample.
+static void BM_ControllerPose(benchmark::State &state)
+{
+	ControllerState controller;
+	double position[3] = { 0.1, 0.2, 0.3 };
+	double step[3] = { 0.001, -0.002, 0.003 };
+	double trackpad[2] = { 0.0, 0.0 };
+	double headPosition[3] = { 0.0, 1.6, 0.0 };
+	controller.set_input(position, step, trackpad, false, 0.0);
+	uint64_t now = GetTimestampUs();
+	controller.sampleTime = now - 20000;
+
+	PoseResult pose;
+	for (auto _ : state)
+	{
+		controller.pose(0, 0.3, headPosition, now, pose);
+		benchmark::DoNotOptimize(pose);
+	}
+}
+BENCHMARK(BM_ControllerPose);
+
+static void BM_EulerToQuaternion(benchmark::State &state)
+{
+	double angle = 0.1;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(angle);
+		PoseRotation rotation = EulerToQuaternion(angle, 2.0 * angle, 3.0 * angle);
+		benchmark::DoNotOptimize(rotation);
+	}
+}
+BENCHMARK(BM_EulerToQuaternion);
+
+//----------shared memory-----------
+
+// ClientApp publishing a decoded sample and the driver taking it in a frame.
+static void BM_PublishConsume(benchmark::State &state)
+{
+	BenchLayout bench;
+	std::string json = PoseJson(0);
+	ControllerState left, right;
+	ControllerState *controllers[2] = { &right, &left };
+	PoseFrameReader reader;
+	SharedEvent spaceReady;
+	FrameSample samples[2];
+	for (auto _ : state)
+	{
+		bench.publisher.publish(json.data(), json.size(), GetTimestampUs());
+		benchmark::DoNotOptimize(reader.run(bench.layout.get(), bench.slots, spaceReady, controllers, samples));
+	}
+	if (!samples[0].consumed)
+	{
+		state.SkipWithError("the published sample was not consumed");
+	}
+}
+BENCHMARK(BM_PublishConsume);
+
+// Samples queued faster than the frame rate: N per controller per frame.
+static void BM_ConsumeBacklog(benchmark::State &state)
+{
+	BenchLayout bench;
+	std::string json[2] = { PoseJson(0), PoseJson(1) };
+	ControllerState left, right;
+	ControllerState *controllers[2] = { &right, &left };
+	PoseFrameReader reader;
+	SharedEvent spaceReady;
+	FrameSample samples[2];
+	int perFrame = (int)state.range(0);
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		for (int i = 0; i < perFrame; i++)
+		{
+			bench.publisher.publish(json[0].data(), json[0].size(), GetTimestampUs());
+			bench.publisher.publish(json[1].data(), json[1].size(), GetTimestampUs());
+		}
+		state.ResumeTiming();
+		benchmark::DoNotOptimize(reader.run(bench.layout.get(), bench.slots, spaceReady, controllers, samples));
+	}
+}
+BENCHMARK(BM_ConsumeBacklog)->Arg(1)->Arg(8)->Arg(30);
+
+//----------frame-----------
+
+// RunFrame end to end for two controllers, against a stand-in host: a new
+// message from each phone is decoded and published, and PoseFrameReader::frame
+// reads the slots, has the host turn the samples into poses and stamps the
+// latency stages.
+static void BM_RunFrame(benchmark::State &state)
+{
+	BenchLayout bench;
+	std::string json[2] = { PoseJson(0), PoseJson(1) };
+	ControllerState left, right;
+	ControllerState *controllers[2] = { &right, &left };
+	PoseFrameReader reader;
+	SharedEvent spaceReady;
+	BenchHost host;
+	host.controllers[0] = controllers[0];
+	host.controllers[1] = controllers[1];
+	uint64_t drained = 0;
+	for (auto _ : state)
+	{
+		bench.publisher.publish(json[0].data(), json[0].size(), GetTimestampUs());
+		bench.publisher.publish(json[1].data(), json[1].size(), GetTimestampUs());
+		drained += reader.frame(bench.layout.get(), bench.slots, spaceReady, controllers, host);
+	}
+	if (host.updates != 2 * (uint64_t)state.iterations() || drained != host.updates)
+	{
+		state.SkipWithError("the frame did not see both controllers");
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RunFrame);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "./ShareMem.h"
+
+//----------clock sync-----------
+
+// Puts phone timestamps on the PC clock (GetTimestampUs). ClientApp sends
+//   {"ping":{"t0":<PC clock, us>}}
+// on the connection and the phone answers as soon as it reads it with
+//   {"pong":{"t0":<echoed>,"t1":<received, s>,"t2":<sent, s>}}
+// t1 and t2 come from the clock of the phone's "timestamp". With t3 the
+// arrival of the pong, one exchange puts the phone clock at
+//   ((t1 - t0) + (t2 - t3)) / 2
+// ahead of the PC, give or take half the round trip (t3 - t0) - (t2 - t1).
+// Exchanges that took over twice as long as the fastest one spent their time
+// in some queue and are ignored; a line through the rest gives the offset and
+// how fast it drifts. Phones that never answer keep sendTime unknown.
+static const int kClockSamples = 16;
+static const int kClockMinSamples = 4;
+static const uint64_t kClockFastInterval = 250000;   //us between pings until synchronised
+static const uint64_t kClockInterval = 2000000;      //us between pings after that
+static const uint64_t kClockMaxRoundTrip = 500000;   //us, slower exchanges are discarded
+static const uint64_t kClockRoundTripSlack = 1000;   //us over twice the fastest round trip still used
+static const uint64_t kClockMinDriftSpan = 10000000; //us of history before drift is estimated
+static const double kClockMaxDrift = 0.0005;         //500 ppm; anything beyond is noise
+
+class ClockSync {
+public:
+	ClockSync() { reset(); }
+
+	void reset()
+	{
+		m_count = m_next = 0;
+		m_synced = false;
+		m_nextPing = 0;
+		m_reference = 0;
+		m_offset = 0;
+		m_drift = 0.0;
+		m_roundTrip = 0;
+	}
+
+	bool synced() const { return m_synced; }
+	int64_t offset() const { return m_offset; }     //phone - PC at reference() [us]
+	uint64_t reference() const { return m_reference; }
+	double drift() const { return m_drift; }        //change of the offset per us
+	uint64_t round_trip() const { return m_roundTrip; }
+
+	//writes a ping into buf when one is due. Returns its length, or 0.
+	int ping(uint64_t now, char* buf, size_t size)
+	{
+		if (now < m_nextPing) {
+			return 0;
+		}
+		m_nextPing = now + (m_synced ? kClockInterval : kClockFastInterval);
+		return snprintf(buf, size, "{\"ping\":{\"t0\":%llu}}\n", (unsigned long long)now);
+	}
+
+	//one exchange: t0 and t3 on the PC clock, t1 and t2 on the phone's [us].
+	//Returns false when it cannot be right.
+	bool add(uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3)
+	{
+		if (t3 < t0 || t2 < t1 || t3 - t0 < t2 - t1 || t3 - t0 > kClockMaxRoundTrip) {
+			return false;
+		}
+		Sample& sample = m_samples[m_next];
+		sample.local = t0 + (t3 - t0) / 2;
+		sample.offset = ((int64_t)(t1 - t0) + (int64_t)(t2 - t3)) / 2;
+		sample.roundTrip = (t3 - t0) - (t2 - t1);
+		m_next = (m_next + 1) % kClockSamples;
+		if (m_count < kClockSamples) {
+			m_count++;
+		}
+		fit();
+		return true;
+	}
+
+	//a phone timestamp [us] on the PC clock
+	uint64_t to_local(uint64_t phone) const
+	{
+		//phone = local + offset + drift * (local - reference)
+		int64_t scaled = (int64_t)(phone - m_reference) - m_offset;
+		return m_reference + (uint64_t)(int64_t)llround(scaled / (1.0 + m_drift));
+	}
+
+private:
+	struct Sample {
+		uint64_t local;     //PC time halfway through the exchange
+		int64_t offset;     //phone - PC
+		uint64_t roundTrip; //excluding the time the phone held the ping
+	};
+
+	void fit()
+	{
+		uint64_t fastest = UINT64_MAX;
+		for (int i = 0; i < m_count; i++) {
+			if (m_samples[i].roundTrip < fastest) {
+				fastest = m_samples[i].roundTrip;
+			}
+		}
+		m_roundTrip = fastest;
+
+		//least squares over the exchanges that were not held up, relative to
+		//the first of them so the sums stay small
+		const Sample* base = NULL;
+		int n = 0;
+		double sumX = 0.0, sumY = 0.0, sumXX = 0.0, sumXY = 0.0;
+		uint64_t first = UINT64_MAX, last = 0;
+		for (int i = 0; i < m_count; i++) {
+			const Sample& s = m_samples[i];
+			if (s.roundTrip > 2 * fastest + kClockRoundTripSlack) {
+				continue;
+			}
+			if (base == NULL) {
+				base = &s;
+			}
+			double x = (double)(int64_t)(s.local - base->local);
+			double y = (double)(s.offset - base->offset);
+			sumX += x;
+			sumY += y;
+			sumXX += x * x;
+			sumXY += x * y;
+			first = s.local < first ? s.local : first;
+			last = s.local > last ? s.local : last;
+			n++;
+		}
+
+		double meanX = sumX / n, meanY = sumY / n;
+		double drift = 0.0;
+		double varX = sumXX - sumX * meanX;
+		if (n >= 3 && last - first >= kClockMinDriftSpan && varX > 0.0) {
+			drift = (sumXY - sumX * meanY) / varX;
+			drift = drift > kClockMaxDrift ? kClockMaxDrift : (drift < -kClockMaxDrift ? -kClockMaxDrift : drift);
+		}
+		m_reference = base->local + (uint64_t)(int64_t)llround(meanX);
+		m_offset = base->offset + (int64_t)llround(meanY);
+		m_drift = drift;
+		m_synced = m_count >= kClockMinSamples;
+	}
+
+	Sample m_samples[kClockSamples];
+	int m_count;
+	int m_next;
+	bool m_synced;
+	uint64_t m_nextPing;
+	uint64_t m_reference;
+	int64_t m_offset;
+	double m_drift;
+	uint64_t m_roundTrip;
+};
+
+inline bool IsPong(const char* data, size_t length)
+{
+	static const char kKey[] = "\"pong\"";
+	size_t keyLength = sizeof(kKey) - 1;
+	for (size_t i = 0; i + keyLength <= length && i < 16; i++) {
+		if (memcmp(data + i, kKey, keyLength) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The times of a pong: t0 [us, PC clock], t1 and t2 [s, phone clock].
+struct PongMessage {
+	double t0;
+	double t1;
+	double t2;
+};
+
+static constexpr JsonField<PongMessage> kPongMessageFields[] = {
+	JSON_FIELD(PongMessage, t0, true),
+	JSON_FIELD(PongMessage, t1, true),
+	JSON_FIELD(PongMessage, t2, true),
+};
+
+static constexpr JsonSchema<PongMessage, sizeof(kPongMessageFields) / sizeof(kPongMessageFields[0])>
+	kPongMessageSchema = MakeJsonSchema(kPongMessageFields);
+static_assert(kPongMessageSchema.seed != 0, "no perfect hash for the pong fields");
+
+// {"pong":{...}}: binds the inner object, skips anything else.
+class PongContext : public JsonSkipContext {
+public:
+	explicit PongContext(PongMessage& message) : found(false), m_message(message) {}
+	bool parse_object_item(JsonInput& in, const JsonKey& key)
+	{
+		if (!key.is("pong")) {
+			return JsonSkipContext::parse_object_item(in, key);
+		}
+		JsonBindResult result = JsonBindValue(kPongMessageSchema, in, m_message);
+		found = (result.error == JsonBind_Ok);
+		return result.error == JsonBind_Ok || result.error == JsonBind_Missing
+			|| result.error == JsonBind_WrongType;
+	}
+	bool found;
+
+private:
+	PongMessage& m_message;
+};
+
+// Reads the times out of a pong, in us. Anything that does not fit the
+// clocks - negative, infinite, beyond 63 bits - is no pong.
+inline bool ParsePong(const char* data, size_t length, uint64_t& t0, uint64_t& t1, uint64_t& t2)
+{
+	PongMessage message = {};
+	PongContext ctx(message);
+	JsonInput in(data, data + length);
+	if (!JsonStreamValue(ctx, in) || !ctx.found) {
+		return false;
+	}
+	double phone1 = message.t1 * 1000000.0, phone2 = message.t2 * 1000000.0;
+	if (!JsonInRange(message.t0, kJsonUint64Limit) || !JsonInRange(phone1, kJsonInt64Limit)
+		|| !JsonInRange(phone2, kJsonInt64Limit)) {
+		return false;
+	}
+	t0 = (uint64_t)message.t0;
+	t1 = (uint64_t)llround(phone1);
+	t2 = (uint64_t)llround(phone2);
+	return true;
+}
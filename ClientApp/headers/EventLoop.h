@@ -0,0 +1,298 @@
+#pragma once
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+//----------sockets-----------
+
+// The few Winsock names ClientApp uses, mapped onto BSD sockets elsewhere.
+#ifndef _WIN32
+typedef int SOCKET;
+typedef struct { int unused; } WSADATA;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_SEND SHUT_WR
+#define MAKEWORD(a, b) ((a) | ((b) << 8))
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define WSAECONNRESET ECONNRESET
+#define WSAEMSGSIZE EMSGSIZE
+inline int WSAStartup(int, WSADATA*) { return 0; }
+inline int WSACleanup() { return 0; }
+inline int WSAGetLastError() { return errno; }
+inline int closesocket(SOCKET s) { return close(s); }
+#endif
+
+inline bool SetNonBlocking(SOCKET s)
+{
+#ifdef _WIN32
+	u_long enable = 1;
+	return ioctlsocket(s, FIONBIO, &enable) == 0;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+//----------poller-----------
+
+// Readiness of many sockets at once: epoll on Linux, WSAPoll on Windows.
+// Level triggered, so a socket that still has data is reported again.
+// Hang-ups and errors are reported as ready too; the next recv tells which.
+struct PollEvent {
+	void* context;
+};
+
+class Poller {
+public:
+	Poller()
+	{
+#ifndef _WIN32
+		m_epoll = epoll_create1(0);
+#endif
+	}
+
+	~Poller()
+	{
+#ifndef _WIN32
+		if (m_epoll >= 0) {
+			close(m_epoll);
+		}
+#endif
+	}
+
+	bool is_open() const
+	{
+#ifdef _WIN32
+		return true;
+#else
+		return m_epoll >= 0;
+#endif
+	}
+
+	bool add(SOCKET s, void* context)
+	{
+#ifdef _WIN32
+		WSAPOLLFD fd = {};
+		fd.fd = s;
+		fd.events = POLLRDNORM;
+		m_fds.push_back(fd);
+		m_contexts.push_back(context);
+		return true;
+#else
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = context;
+		return epoll_ctl(m_epoll, EPOLL_CTL_ADD, s, &ev) == 0;
+#endif
+	}
+
+	void remove(SOCKET s)
+	{
+#ifdef _WIN32
+		for (size_t i = 0; i < m_fds.size(); i++) {
+			if (m_fds[i].fd == s) {
+				m_fds.erase(m_fds.begin() + i);
+				m_contexts.erase(m_contexts.begin() + i);
+				break;
+			}
+		}
+#else
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, s, NULL);
+#endif
+	}
+
+	//waits up to timeoutMs; returns the number of events, or -1 on error
+	int wait(PollEvent* events, int maxEvents, int timeoutMs)
+	{
+#ifdef _WIN32
+		int ready = WSAPoll(m_fds.data(), (ULONG)m_fds.size(), timeoutMs);
+		if (ready <= 0) {
+			return ready;
+		}
+		int count = 0;
+		for (size_t i = 0; i < m_fds.size() && count < maxEvents; i++) {
+			if (m_fds[i].revents != 0) {
+				events[count++].context = m_contexts[i];
+			}
+		}
+		return count;
+#else
+		epoll_event ready[64];
+		int count = epoll_wait(m_epoll, ready, maxEvents < 64 ? maxEvents : 64, timeoutMs);
+		if (count < 0) {
+			return errno == EINTR ? 0 : -1;
+		}
+		for (int i = 0; i < count; i++) {
+			events[i].context = ready[i].data.ptr;
+		}
+		return count;
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	std::vector<WSAPOLLFD> m_fds;
+	std::vector<void*> m_contexts;
+#else
+	int m_epoll = -1;
+#endif
+};
+
+//----------waker-----------
+
+// Lets another thread end a Poller::wait early: a loopback datagram socket
+// that is polled like the others and becomes readable on wake().
+class PollWaker {
+public:
+	~PollWaker()
+	{
+		close();
+	}
+
+	bool open()
+	{
+		close();
+		m_receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		m_sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(address);
+		if (m_receiver == INVALID_SOCKET || m_sender == INVALID_SOCKET
+			|| bind(m_receiver, (sockaddr*)&address, sizeof(address)) != 0
+			|| getsockname(m_receiver, (sockaddr*)&address, &length) != 0
+			|| connect(m_sender, (sockaddr*)&address, sizeof(address)) != 0
+			|| !SetNonBlocking(m_receiver) || !SetNonBlocking(m_sender)) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (m_receiver != INVALID_SOCKET) {
+			closesocket(m_receiver);
+			m_receiver = INVALID_SOCKET;
+		}
+		if (m_sender != INVALID_SOCKET) {
+			closesocket(m_sender);
+			m_sender = INVALID_SOCKET;
+		}
+	}
+
+	//the socket to add to the poller
+	SOCKET receiver() const
+	{
+		return m_receiver;
+	}
+
+	//any thread
+	void wake()
+	{
+		char byte = 0;
+		send(m_sender, &byte, 1, 0);
+	}
+
+	//the polling thread, once the receiver was reported ready
+	void drain()
+	{
+		char buf[64];
+		while (recv(m_receiver, buf, sizeof(buf), 0) > 0) {
+		}
+	}
+
+private:
+	SOCKET m_receiver = INVALID_SOCKET;
+	SOCKET m_sender = INVALID_SOCKET;
+};
+
+//----------datagram batch-----------
+
+// Preallocated buffers for receiving many datagrams per call. On Linux one
+// recvmmsg() fills all of them with whatever is queued; elsewhere each call
+// takes a single recvfrom().
+static const int kDatagramBatch = 32;
+static const size_t kDatagramSize = 2048;
+
+class DatagramBatch {
+public:
+	DatagramBatch()
+	{
+#ifdef __linux__
+		memset(m_headers, 0, sizeof(m_headers));
+		for (int i = 0; i < kDatagramBatch; i++) {
+			m_iov[i].iov_base = m_buffers[i];
+			m_iov[i].iov_len = kDatagramSize;
+			m_headers[i].msg_hdr.msg_iov = &m_iov[i];
+			m_headers[i].msg_hdr.msg_iovlen = 1;
+			m_headers[i].msg_hdr.msg_name = &m_from[i];
+		}
+#endif
+	}
+
+	//receives what is queued on a readable socket. Returns the number of
+	//datagrams, or SOCKET_ERROR with the reason in WSAGetLastError().
+	int receive(SOCKET s)
+	{
+#ifdef __linux__
+		for (int i = 0; i < kDatagramBatch; i++) {
+			m_headers[i].msg_hdr.msg_namelen = sizeof(m_from[i]);
+		}
+		int count = recvmmsg(s, m_headers, kDatagramBatch, MSG_DONTWAIT, NULL);
+		if (count < 0) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : SOCKET_ERROR;
+		}
+		for (int i = 0; i < count; i++) {
+			//a truncated datagram cannot be decoded; leave it empty
+			m_lengths[i] = (m_headers[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : m_headers[i].msg_len;
+			m_fromLengths[i] = m_headers[i].msg_hdr.msg_namelen;
+		}
+		return count;
+#else
+		m_fromLengths[0] = sizeof(m_from[0]);
+		int length = recvfrom(s, m_buffers[0], (int)kDatagramSize, 0, (sockaddr*)&m_from[0], &m_fromLengths[0]);
+		if (length < 0) {
+			return SOCKET_ERROR;
+		}
+		m_lengths[0] = (size_t)length;
+		return 1;
+#endif
+	}
+
+	const char* data(int i) const { return m_buffers[i]; }
+	size_t length(int i) const { return m_lengths[i]; }
+	const sockaddr* from(int i) const { return (const sockaddr*)&m_from[i]; }
+	socklen_t from_length(int i) const { return m_fromLengths[i]; }
+
+private:
+#ifdef __linux__
+	mmsghdr m_headers[kDatagramBatch];
+	iovec m_iov[kDatagramBatch];
+	static const int kBuffers = kDatagramBatch;
+#else
+	static const int kBuffers = 1;
+#endif
+	char m_buffers[kBuffers][kDatagramSize];
+	size_t m_lengths[kBuffers];
+	sockaddr_storage m_from[kBuffers];
+	socklen_t m_fromLengths[kBuffers];
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "./WireFormat.h"
+
+//----------framing-----------
+
+// A TCP stream has no message boundaries: one recv can return half a message
+// or several of them. FrameReader buffers the stream and cuts it back into
+// messages. The framing is picked from the first byte of the connection:
+//  '{' or whitespace: JSON objects back to back, optionally one per line,
+//                     mixed with fixed size binary poses (kWireMagic)
+//  anything else:     2 byte big endian length, then the message
+// (a length prefix starts below 0x09 for any message under 2304 bytes)
+enum FramingMode {
+	Framing_Unknown,
+	Framing_Json,
+	Framing_LengthPrefix,
+};
+
+struct Frame {
+	const char* data;
+	size_t length;
+};
+
+static const size_t kFrameBufferSize = 16384;
+static const int kMaxFramesPerRead = 32;
+
+class FrameReader {
+public:
+	FrameReader() { reset(); }
+
+	void reset()
+	{
+		m_mode = Framing_Unknown;
+		m_start = m_end = m_scan = 0;
+		m_depth = 0;
+		m_inString = m_escape = false;
+	}
+
+	FramingMode mode() const { return m_mode; }
+
+	//space to recv into. Frames returned by next() become invalid.
+	char* prepare(size_t& space)
+	{
+		if (m_start > 0) {
+			memmove(m_buf, m_buf + m_start, m_end - m_start);
+			m_end -= m_start;
+			m_scan -= m_start;
+			m_start = 0;
+		}
+		space = kFrameBufferSize - m_end;
+		return m_buf + m_end;
+	}
+
+	void received(size_t length)
+	{
+		m_end += length;
+	}
+
+	//extracts up to maxFrames complete messages. Returns their count, or -1
+	//when the stream cannot be framed (a message longer than the buffer).
+	int next(Frame* frames, int maxFrames)
+	{
+		if (m_mode == Framing_Unknown && m_start < m_end) {
+			char c = m_buf[m_start];
+			m_mode = (c == '{' || IsSpace(c) || (uint8_t)c == kWireMagic) ? Framing_Json : Framing_LengthPrefix;
+		}
+
+		int count = 0;
+		while (count < maxFrames) {
+			bool found = (m_mode == Framing_Json) ? next_json(frames[count]) : next_prefixed(frames[count]);
+			if (!found) {
+				break;
+			}
+			count++;
+		}
+		if (count == 0 && m_start == 0 && m_end == kFrameBufferSize) {
+			return -1;
+		}
+		return count;
+	}
+
+private:
+	static bool IsSpace(char c)
+	{
+		return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+	}
+
+	bool next_prefixed(Frame& frame)
+	{
+		if (m_end - m_start < 2) {
+			return false;
+		}
+		size_t length = ((size_t)(uint8_t)m_buf[m_start] << 8) | (uint8_t)m_buf[m_start + 1];
+		if (m_end - m_start - 2 < length) {
+			return false;
+		}
+		frame.data = m_buf + m_start + 2;
+		frame.length = length;
+		m_start += 2 + length;
+		m_scan = m_start;
+		return true;
+	}
+
+	//tracks brace depth outside of strings, so neither newlines nor the
+	//lack of them matter. Text that is not an object runs to the end of its
+	//line and is returned as a frame of its own for the decoder to reject.
+	bool next_json(Frame& frame)
+	{
+		if (m_depth == 0) {
+			while (m_start < m_end && IsSpace(m_buf[m_start])) {
+				m_start++;
+			}
+			m_scan = m_start;
+			if (m_start < m_end && (uint8_t)m_buf[m_start] == kWireMagic) {
+				if (m_end - m_start < kWirePacketSize) {
+					return false;
+				}
+				m_scan = m_start + kWirePacketSize;
+				return take(frame, m_start);
+			}
+		}
+		size_t begin = m_start;
+		while (m_scan < m_end) {
+			char c = m_buf[m_scan++];
+			if (m_scan - 1 == begin && c != '{') {
+				m_inString = m_escape = false;
+				m_depth = -1; //skipping a malformed line
+				continue;
+			}
+			if (m_depth < 0) {
+				if (c == '\n') {
+					return take(frame, begin);
+				}
+				continue;
+			}
+			if (m_inString) {
+				if (m_escape) {
+					m_escape = false;
+				}
+				else if (c == '\\') {
+					m_escape = true;
+				}
+				else if (c == '"') {
+					m_inString = false;
+				}
+				continue;
+			}
+			if (c == '"') {
+				m_inString = true;
+			}
+			else if (c == '{' || c == '[') {
+				m_depth++;
+			}
+			else if ((c == '}' || c == ']') && --m_depth == 0) {
+				return take(frame, begin);
+			}
+		}
+		return false;
+	}
+
+	bool take(Frame& frame, size_t begin)
+	{
+		frame.data = m_buf + begin;
+		frame.length = m_scan - begin;
+		m_start = m_scan;
+		m_depth = 0;
+		return true;
+	}
+
+	char m_buf[kFrameBufferSize];
+	FramingMode m_mode;
+	size_t m_start; //first byte not returned as a frame yet
+	size_t m_end;   //end of received data
+	size_t m_scan;  //json: next byte to look at
+	int m_depth;    //json: open braces, -1 while skipping a malformed line
+	bool m_inString;
+	bool m_escape;
+};
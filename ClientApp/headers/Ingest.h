@@ -0,0 +1,942 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "./EventLoop.h"
+#include "./ShareMem.h"
+#include "./Framing.h"
+#include "./WireFormat.h"
+#include "./SessionLog.h"
+#include "./ClockSync.h"
+
+// The receive side of the phone link: sockets in, PosePackets out into a
+// SharedLayout. Client.exe runs it against the shared memory; the driver can
+// run it on a thread of its own against a layout in its own process.
+
+// Where connections and socket errors are reported. Define it before
+// including this header to send them somewhere else than stdout.
+#ifndef INGEST_LOG
+#define INGEST_LOG printf
+#endif
+
+//----------socket-----------
+
+// Creates the socket phones send to: bound to 'port' on all interfaces, and
+// listening when it is TCP. Returns INVALID_SOCKET on failure.
+inline SOCKET OpenIngestSocket(const char *port, bool udp)
+{
+	struct addrinfo *result = NULL, hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+	hints.ai_protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE;
+	int iResult = getaddrinfo(NULL, port, &hints, &result);
+	if (iResult != 0)
+	{
+		INGEST_LOG("getaddrinfo failed: %d\n", iResult);
+		return INVALID_SOCKET;
+	}
+
+	SOCKET listenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	if (listenSocket == INVALID_SOCKET)
+	{
+		INGEST_LOG("Error at socket(): %d\n", (int)WSAGetLastError());
+		freeaddrinfo(result);
+		return INVALID_SOCKET;
+	}
+	iResult = bind(listenSocket, result->ai_addr, (int)result->ai_addrlen);
+	freeaddrinfo(result);
+	if (iResult == SOCKET_ERROR)
+	{
+		INGEST_LOG("bind failed with error: %d\n", (int)WSAGetLastError());
+		closesocket(listenSocket);
+		return INVALID_SOCKET;
+	}
+	if (!udp && listen(listenSocket, SOMAXCONN) == SOCKET_ERROR)
+	{
+		INGEST_LOG("Listen failed with error: %d\n", (int)WSAGetLastError());
+		closesocket(listenSocket);
+		return INVALID_SOCKET;
+	}
+	return listenSocket;
+}
+
+//----------publisher-----------
+
+// Decodes phone messages directly into the next free ring slot and publishes
+// them by advancing the ring head, so a sample is never copied through an
+// intermediate buffer on its way to the driver.
+class PosePublisher
+{
+public:
+	void attach(SharedLayout *layout)
+	{
+		m_layout = layout;
+		m_layout->header.producerPid.store(GetCurrentPid(), std::memory_order_relaxed);
+		//haptics queued while no client app was attached are long over
+		m_layout->feedback.clear();
+		ResetSessionStats(m_layout);
+		m_sequence = m_layout->stats.lastSequence.load(std::memory_order_relaxed);
+	}
+
+	//range of binary poses, announced to the phones in the hello reply
+	void set_wire_config(const WireConfig &config)
+	{
+		m_wire = config;
+		if (m_recorder != NULL)
+		{
+			m_recorder->set_position_range(m_wire.positionRange);
+		}
+	}
+
+	const WireConfig &wire_config() const
+	{
+		return m_wire;
+	}
+
+	//every received message is also appended to the recorder
+	void record_to(SessionRecorder *recorder)
+	{
+		m_recorder = recorder;
+		if (m_recorder != NULL)
+		{
+			m_recorder->set_position_range(m_wire.positionRange);
+		}
+	}
+
+	//work kept off the receive path, called whenever the loop is idle. It
+	//also shows the producer is alive while no phone is sending.
+	void maintain()
+	{
+		m_layout->header.heartbeat.fetch_add(1, std::memory_order_relaxed);
+		if (m_recorder != NULL)
+		{
+			m_recorder->maintain();
+		}
+	}
+
+	bool has_space()
+	{
+		return m_layout->ring.reserve() != NULL;
+	}
+
+	//drop samples that arrive after a newer one of the same device
+	void drop_late(bool enable)
+	{
+		m_dropLate = enable;
+		m_arrival.reset();
+	}
+
+	//returns the phone id of the published sample, or -1. 'clock' is the
+	//phone's, when its timestamps can be put on the PC clock. 'source' tells
+	//the phones apart for drop_late.
+	int publish(const char *data, size_t length, uint64_t recvTime, const ClockSync *clock = NULL,
+		uint32_t source = 0)
+	{
+		//when the ring is full the sample still reaches the latest value slot
+		PosePacket *packet = m_layout->ring.reserve();
+		bool queued = (packet != NULL);
+		if (!queued)
+		{
+			packet = &m_overflow;
+		}
+
+		int slot = decode(data, length, recvTime, source, true, *packet);
+		if (slot < 0)
+		{
+			return -1;
+		}
+		finish(slot, *packet, queued, recvTime, clock);
+		return (int)packet->id;
+	}
+
+	//publishes messages that arrived together. When the phone got ahead of
+	//us only the newest sample of each device is kept, with the clicks of the
+	//others, and the rest count as late.
+	//'ids' collects the phone ids that were seen.
+	void publish_burst(const Frame *frames, int count, uint64_t recvTime, uint32_t &ids,
+		const ClockSync *clock = NULL, uint32_t source = 0)
+	{
+		if (count == 1)
+		{
+			int id = publish(frames[0].data, frames[0].length, recvTime, clock, source);
+			if (id >= 0 && id < 32)
+			{
+				ids |= 1u << id;
+			}
+			return;
+		}
+
+		uint32_t pending = 0;
+		for (int i = 0; i < count; i++)
+		{
+			int slot = decode(frames[i].data, frames[i].length, recvTime, source, i == 0, m_burst[kMaxDevices]);
+			if (slot < 0)
+			{
+				continue;
+			}
+			//a click only in a dropped sample still reaches the driver
+			uint32_t clicked = 0;
+			if (pending & (1u << slot))
+			{
+				m_layout->stats.packetsLate.fetch_add(1, std::memory_order_relaxed);
+				clicked = m_burst[slot].clicked;
+			}
+			pending |= 1u << slot;
+			m_burst[slot] = m_burst[kMaxDevices];
+			m_burst[slot].clicked |= clicked;
+		}
+		if (pending == 0)
+		{
+			return;
+		}
+
+		for (uint32_t slot = 0; slot < kMaxDevices; slot++)
+		{
+			if ((pending & (1u << slot)) == 0)
+			{
+				continue;
+			}
+			PosePacket *packet = m_layout->ring.reserve();
+			bool queued = (packet != NULL);
+			if (!queued)
+			{
+				packet = &m_overflow;
+			}
+			*packet = m_burst[slot];
+			finish(slot, *packet, queued, recvTime, clock);
+			if (packet->id < 32)
+			{
+				ids |= 1u << packet->id;
+			}
+		}
+	}
+
+private:
+	//parses a message into packet and returns its device slot, or -1 when
+	//it is malformed, has values the driver cannot use, or is older than what
+	//was already published. 'burstStart' is false for the later messages of
+	//a burst, so a replay can group them again.
+	int decode(const char *data, size_t length, uint64_t recvTime, uint32_t source, bool burstStart,
+		PosePacket &packet)
+	{
+		if (m_recorder != NULL)
+		{
+			uint16_t flags = (burstStart ? kSessionLogBurstStart : 0) | (m_dropLate ? kSessionLogDropLate : 0);
+			m_recorder->append(data, length, recvTime, source, flags);
+		}
+
+		StatsPage &stats = m_layout->stats;
+		stats.packetsReceived.fetch_add(1, std::memory_order_relaxed);
+		stats.bytesReceived.fetch_add(length, std::memory_order_relaxed);
+		m_layout->header.heartbeat.fetch_add(1, std::memory_order_relaxed);
+
+		int slot = -1;
+		uint32_t phoneSequence = 0;
+		JsonBindResult error = {};
+		bool decoded = IsWirePacket(data, length)
+			? DecodeWirePacket(data, length, m_wire, packet, &phoneSequence)
+			: DecodePosePacket(data, length, packet, &phoneSequence, &error);
+		if (decoded && ValidatePosePacket(packet))
+		{
+			slot = FindPhoneSlot(m_layout, packet.id);
+		}
+		if (slot < 0)
+		{
+			uint64_t failures = stats.parseFailures.fetch_add(1, std::memory_order_relaxed) + 1;
+			log_refused(error, failures, recvTime);
+			return -1;
+		}
+
+		uint32_t lost = 0;
+		if (m_dropLate && !m_arrival.accept(slot, source, phoneSequence, packet.sendTime, lost))
+		{
+			stats.packetsLate.fetch_add(1, std::memory_order_relaxed);
+			return -1;
+		}
+		if (lost > 0)
+		{
+			stats.packetsLost.fetch_add(lost, std::memory_order_relaxed);
+		}
+		return slot;
+	}
+
+	//at most one line a second, however fast a phone sends bad messages
+	void log_refused(const JsonBindResult &error, uint64_t failures, uint64_t recvTime)
+	{
+		if (m_lastRefusedLog != 0 && recvTime - m_lastRefusedLog < 1000000)
+		{
+			return;
+		}
+		m_lastRefusedLog = recvTime;
+		if (error.error != JsonBind_Ok && error.field >= 0)
+		{
+			INGEST_LOG("refused a pose: %s %s (%llu so far)\n", kPoseMessageSchema.fields[error.field].name,
+				JsonBindErrorName(error.error), (unsigned long long)failures);
+		}
+		else if (error.error != JsonBind_Ok)
+		{
+			INGEST_LOG("refused a pose: %s at line %d (%llu so far)\n", JsonBindErrorName(error.error), error.line,
+				(unsigned long long)failures);
+		}
+		else
+		{
+			INGEST_LOG("refused a pose: unknown device or value out of range (%llu so far)\n",
+				(unsigned long long)failures);
+		}
+	}
+
+	//stamps a decoded packet and makes it visible to the driver
+	void finish(int slot, PosePacket &packet, bool queued, uint64_t recvTime, const ClockSync *clock)
+	{
+		StatsPage &stats = m_layout->stats;
+		//the phone's own clock means nothing to the driver
+		bool synced = (clock != NULL && clock->synced() && packet.sendTime != 0);
+		packet.sendTime = synced ? clock->to_local(packet.sendTime) : 0;
+		packet.recvTime = recvTime;
+		packet.publishTime = GetTimestampUs();
+		packet.sequence = ++m_sequence;
+		m_layout->devices[slot].write(packet);
+		if (queued)
+		{
+			m_layout->ring.commit();
+		}
+		else
+		{
+			stats.packetsDropped.fetch_add(1, std::memory_order_relaxed);
+		}
+		stats.lastSequence.store(m_sequence, std::memory_order_relaxed);
+
+		m_layout->latency.stages[LatencyStage_SendToRecv].record_span(packet.sendTime, packet.recvTime);
+		m_layout->latency.stages[LatencyStage_RecvToPublish].record_span(packet.recvTime, packet.publishTime);
+	}
+
+	SharedLayout *m_layout = NULL;
+	uint32_t m_sequence = 0;
+	PosePacket m_overflow;
+	bool m_dropLate = false;
+	ArrivalFilter m_arrival;
+	WireConfig m_wire;
+	SessionRecorder *m_recorder = NULL;
+	uint64_t m_lastRefusedLog = 0;
+	PosePacket m_burst[kMaxDevices + 1]; //newest per slot, then scratch
+};
+
+//----------feedback-----------
+
+// Formats one driver feedback event as a line of JSON for the phone.
+inline int FormatFeedback(const FeedbackEvent &ev, char *buf, size_t size)
+{
+	if (ev.type == FeedbackType_Haptic)
+	{
+		return snprintf(buf, size, "{\"haptic\":{\"id\":%u,\"duration\":%g,\"frequency\":%g,\"amplitude\":%g}}\n",
+			ev.id, ev.duration, ev.frequency, ev.amplitude);
+	}
+	if (ev.type == FeedbackType_Status)
+	{
+		return snprintf(buf, size, "{\"status\":{\"id\":%u,\"tracking\":%s}}\n",
+			ev.id, (ev.status & DeviceStatus_Tracking) ? "true" : "false");
+	}
+	return 0;
+}
+
+// Feedback lines for one phone, sent with a single send() per frame. What a
+// non-blocking connection does not take stays queued and goes first on the
+// next flush, so a phone never sees half a line; when the queue is full,
+// new lines are dropped whole.
+struct FeedbackBatch
+{
+	char buf[2048];
+	size_t length = 0;
+
+	void append(const FeedbackEvent &ev)
+	{
+		if (length < sizeof(buf) - 128)
+		{
+			length += FormatFeedback(ev, buf + length, sizeof(buf) - length);
+		}
+	}
+
+	//a line formatted elsewhere, such as a clock ping
+	void append(const char *line, int lineLength)
+	{
+		if (lineLength > 0 && length + lineLength <= sizeof(buf))
+		{
+			memcpy(buf + length, line, lineLength);
+			length += lineLength;
+		}
+	}
+
+	//'to' is the phone's address on an unconnected (udp) socket, NULL otherwise
+	void flush(SOCKET socket, const sockaddr *to = NULL, socklen_t toLength = 0)
+	{
+		if (length == 0)
+		{
+			return;
+		}
+		int sent = sendto(socket, buf, (int)length, 0, to, toLength);
+		if (sent == SOCKET_ERROR && to == NULL && WSAGetLastError() == WSAEWOULDBLOCK)
+		{
+			return;
+		}
+		//a datagram goes whole or is lost, and a failed connection is
+		//noticed by the poller
+		if (sent == SOCKET_ERROR || to != NULL)
+		{
+			sent = (int)length;
+		}
+		memmove(buf, buf + sent, length - sent);
+		length -= sent;
+	}
+};
+
+inline bool HasId(uint32_t ids, uint32_t id)
+{
+	return id < 32 && (ids & (1u << id)) != 0;
+}
+
+// Feeds the pongs among the frames to the phone's clock and removes them.
+inline int TakePongs(Frame *frames, int count, ClockSync &clock, uint64_t recvTime, const char *peer)
+{
+	int poses = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (!IsPong(frames[i].data, frames[i].length))
+		{
+			frames[poses++] = frames[i];
+			continue;
+		}
+		uint64_t t0, t1, t2;
+		bool synced = clock.synced();
+		if (ParsePong(frames[i].data, frames[i].length, t0, t1, t2) && clock.add(t0, t1, t2, recvTime)
+			&& !synced && clock.synced())
+		{
+			INGEST_LOG("%s: clock synchronised, %+lld us from the PC, round trip %llu us\n", peer,
+				(long long)clock.offset(), (unsigned long long)clock.round_trip());
+		}
+	}
+	return poses;
+}
+
+// Replies to the hellos among the frames and removes them, leaving the poses.
+// 'to' is the phone's address on an unconnected (udp) socket, NULL otherwise.
+inline int AnswerHellos(Frame *frames, int count, const WireConfig &config, SOCKET socket,
+	const sockaddr *to = NULL, socklen_t toLength = 0)
+{
+	int poses = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (!IsHello(frames[i].data, frames[i].length))
+		{
+			frames[poses++] = frames[i];
+			continue;
+		}
+		char reply[256];
+		int length = AnswerHello(frames[i].data, frames[i].length, config, reply, sizeof(reply));
+		sendto(socket, reply, length, 0, to, toLength);
+	}
+	return poses;
+}
+
+// Wakes a receive loop as soon as the driver publishes feedback, rather
+// than on its next poll timeout. A SharedEvent cannot be polled with the
+// sockets, so a thread waits on it and wakes the loop's poller.
+class FeedbackWatch
+{
+public:
+	~FeedbackWatch()
+	{
+		stop();
+	}
+
+	//polls the waker under 'context'. Without an open event it returns
+	//false, and feedback goes out on the poll timeout as before.
+	bool start(SharedEvent *feedbackReady, Poller &poller, void *context)
+	{
+		if (feedbackReady == NULL || !feedbackReady->is_open() || !m_waker.open()
+			|| !poller.add(m_waker.receiver(), context))
+		{
+			return false;
+		}
+		m_stop.store(false);
+		m_thread = std::thread([this, feedbackReady]() {
+			uint32_t seen = feedbackReady->current();
+			while (!m_stop.load(std::memory_order_relaxed))
+			{
+				if (feedbackReady->wait(seen, 100))
+				{
+					m_waker.wake();
+				}
+			}
+		});
+		return true;
+	}
+
+	//the loop saw the waker ready
+	void woken()
+	{
+		m_waker.drain();
+	}
+
+	void stop()
+	{
+		if (m_thread.joinable())
+		{
+			m_stop.store(true);
+			m_thread.join();
+		}
+	}
+
+private:
+	PollWaker m_waker;
+	std::thread m_thread;
+	std::atomic<bool> m_stop{ false };
+};
+
+//----------receivers-----------
+
+// A phone sending datagrams, told apart by its address.
+struct DatagramPeer
+{
+	sockaddr_storage address;
+	socklen_t addressLength = 0;
+	char name[64];
+	uint64_t lastSeen = 0;
+	ClockSync clock;
+	uint32_t ids = 0; //ids this phone sends
+	FeedbackBatch feedback;
+	uint32_t source = 0; //new for every address, see PosePublisher::publish
+};
+
+static const int kMaxDatagramPeers = 8;
+static const uint64_t kDatagramPeerTimeout = 5000000; //us of silence before a phone is no longer pinged
+
+// The peer a datagram came from; a new address replaces the quietest peer
+// and gets the next number from 'sources'.
+inline DatagramPeer *FindDatagramPeer(DatagramPeer *peers, const sockaddr *from, socklen_t fromLength, uint64_t now,
+	uint32_t &sources)
+{
+	DatagramPeer *quietest = &peers[0];
+	for (int i = 0; i < kMaxDatagramPeers; i++)
+	{
+		if (peers[i].addressLength == fromLength && memcmp(&peers[i].address, from, fromLength) == 0)
+		{
+			peers[i].lastSeen = now;
+			return &peers[i];
+		}
+		if (peers[i].lastSeen < quietest->lastSeen)
+		{
+			quietest = &peers[i];
+		}
+	}
+	DatagramPeer *peer = quietest;
+	memcpy(&peer->address, from, fromLength);
+	peer->addressLength = fromLength;
+	char host[48] = "?", port[16] = "?";
+	getnameinfo(from, fromLength, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+	snprintf(peer->name, sizeof(peer->name), "%s:%s", host, port);
+	peer->lastSeen = now;
+	peer->clock.reset();
+	peer->ids = 0;
+	peer->feedback.length = 0;
+	peer->source = ++sources;
+	return peer;
+}
+
+// Receives one JSON pose per datagram. Nothing waits for a lost or delayed
+// datagram: whatever arrives after a newer sample of its device is dropped.
+// Feedback for a device goes to the phone that last sent its poses, and
+// every recent phone gets clock pings.
+// Runs until the socket fails or 'stop' is set. 'feedbackReady', if open,
+// wakes the loop for feedback.
+inline int ReceiveDatagrams(SOCKET socket, SharedLayout *layout, PosePublisher &publisher,
+	const std::atomic<bool> *stop = NULL, SharedEvent *feedbackReady = NULL)
+{
+	publisher.drop_late(true);
+
+	Poller poller;
+	if (!poller.is_open() || !poller.add(socket, NULL))
+	{
+		INGEST_LOG("cannot poll the socket\n");
+		return 1;
+	}
+	FeedbackWatch feedbackWatch;
+	feedbackWatch.start(feedbackReady, poller, &feedbackWatch);
+
+	std::unique_ptr<DatagramBatch> batch(new DatagramBatch());
+	std::unique_ptr<DatagramPeer[]> peers(new DatagramPeer[kMaxDatagramPeers]);
+	Frame frames[kDatagramBatch], group[kDatagramBatch];
+	DatagramPeer *senders[kDatagramBatch];
+	uint32_t sources = 0;
+	while (stop == NULL || !stop->load(std::memory_order_relaxed))
+	{
+		const FeedbackEvent *ev;
+		while ((ev = layout->feedback.front()) != NULL)
+		{
+			for (int i = 0; i < kMaxDatagramPeers; i++)
+			{
+				if (HasId(peers[i].ids, ev->id))
+				{
+					peers[i].feedback.append(*ev);
+				}
+			}
+			layout->feedback.pop();
+		}
+		uint64_t now = GetTimestampUs();
+		for (int i = 0; i < kMaxDatagramPeers; i++)
+		{
+			DatagramPeer &peer = peers[i];
+			peer.feedback.flush(socket, (const sockaddr *)&peer.address, peer.addressLength);
+			char ping[64];
+			int pingLength = (peer.addressLength > 0 && now - peer.lastSeen < kDatagramPeerTimeout)
+				? peer.clock.ping(now, ping, sizeof(ping)) : 0;
+			if (pingLength > 0)
+			{
+				sendto(socket, ping, pingLength, 0, (const sockaddr *)&peer.address, peer.addressLength);
+			}
+		}
+		publisher.maintain();
+
+		PollEvent event;
+		int iResult = poller.wait(&event, 1, 5);
+		if (iResult == 0)
+		{
+			continue;
+		}
+		if (iResult > 0 && event.context == &feedbackWatch)
+		{
+			feedbackWatch.woken();
+			continue;
+		}
+
+		if (iResult != SOCKET_ERROR)
+		{
+			iResult = batch->receive(socket);
+		}
+		uint64_t recvTime = GetTimestampUs();
+		if (iResult == SOCKET_ERROR)
+		{
+			//an unreachable phone reports back as a reset, and an oversized
+			//datagram is truncated; neither stops the listener
+			int error = WSAGetLastError();
+			if (error == WSAECONNRESET || error == WSAEMSGSIZE)
+			{
+				continue;
+			}
+			INGEST_LOG("recvfrom failed: %d\n", error);
+			return 1;
+		}
+
+		int poses = 0;
+		for (int i = 0; i < iResult; i++)
+		{
+			Frame frame = { batch->data(i), batch->length(i) };
+			if (frame.length == 0)
+			{
+				continue;
+			}
+			DatagramPeer *peer = FindDatagramPeer(peers.get(), batch->from(i), batch->from_length(i), recvTime, sources);
+			if (AnswerHellos(&frame, 1, publisher.wire_config(), socket, batch->from(i), batch->from_length(i)) == 1
+				&& TakePongs(&frame, 1, peer->clock, recvTime, peer->name) == 1)
+			{
+				senders[poses] = peer;
+				frames[poses++] = frame;
+			}
+		}
+
+		//everything a phone had queued is published as one burst, so a phone
+		//that got ahead of us only costs the newest pose per device
+		for (int i = 0; i < poses; i++)
+		{
+			DatagramPeer *peer = senders[i];
+			if (peer == NULL)
+			{
+				continue;
+			}
+			int count = 0;
+			for (int k = i; k < poses; k++)
+			{
+				if (senders[k] == peer)
+				{
+					group[count++] = frames[k];
+					senders[k] = NULL;
+				}
+			}
+			uint32_t ids = 0;
+			publisher.publish_burst(group, count, recvTime, ids, &peer->clock, peer->source);
+			if (ids != 0)
+			{
+				//a device handed to another phone no longer gets feedback here
+				for (int k = 0; k < kMaxDatagramPeers; k++)
+				{
+					peers[k].ids &= ~ids;
+				}
+				peer->ids |= ids;
+			}
+		}
+	}
+	return 0;
+}
+
+// One phone connected over TCP.
+struct Connection
+{
+	SOCKET socket;
+	char peer[64];
+	uint32_t phoneIds = 0; //ids this phone sends
+	FrameReader reader;
+	FeedbackBatch feedback;
+	ClockSync clock;
+};
+
+// Serves any number of phones at once from a single thread. Each phone owns
+// the device ids it sends; when another phone starts sending an id, it takes
+// the id over, so feedback always goes to the phone driving the device.
+class PoseServer
+{
+public:
+	PoseServer(SharedLayout *layout, PosePublisher &publisher)
+		: m_layout(layout), m_publisher(publisher)
+	{
+		memset(m_owners, 0, sizeof(m_owners));
+	}
+
+	~PoseServer()
+	{
+		while (!m_connections.empty())
+		{
+			disconnect(m_connections.back());
+		}
+	}
+
+	//runs until the listening socket fails or 'stop' is set. 'feedbackReady',
+	//if open, wakes the loop for feedback.
+	int run(SOCKET listenSocket, const std::atomic<bool> *stop = NULL, SharedEvent *feedbackReady = NULL)
+	{
+		m_listenSocket = listenSocket;
+		if (!m_poller.is_open() || !SetNonBlocking(listenSocket) || !m_poller.add(listenSocket, NULL))
+		{
+			INGEST_LOG("cannot poll the listening socket\n");
+			return 1;
+		}
+		m_feedbackWatch.start(feedbackReady, m_poller, &m_feedbackWatch);
+
+		PollEvent events[16];
+		while (stop == NULL || !stop->load(std::memory_order_relaxed))
+		{
+			forward_feedback();
+			send_pings();
+			m_publisher.maintain();
+
+			//wake up regularly to ping, and to forward feedback when
+			//nothing wakes us for it
+			int count = m_poller.wait(events, 16, 5);
+			if (count < 0)
+			{
+				INGEST_LOG("poll failed: %d\n", WSAGetLastError());
+				return 1;
+			}
+			uint64_t recvTime = GetTimestampUs();
+			for (int i = 0; i < count; i++)
+			{
+				if (events[i].context == NULL)
+				{
+					if (!accept_all())
+					{
+						return 1;
+					}
+				}
+				else if (events[i].context == &m_feedbackWatch)
+				{
+					m_feedbackWatch.woken();
+				}
+				else
+				{
+					receive((Connection *)events[i].context, recvTime);
+				}
+			}
+		}
+		return 0;
+	}
+
+private:
+	bool accept_all()
+	{
+		while (true)
+		{
+			sockaddr_storage address;
+			socklen_t addressLength = sizeof(address);
+			SOCKET socket = accept(m_listenSocket, (sockaddr *)&address, &addressLength);
+			if (socket == INVALID_SOCKET)
+			{
+				int error = WSAGetLastError();
+				if (error == WSAEWOULDBLOCK || error == WSAECONNRESET)
+				{
+					return true;
+				}
+				INGEST_LOG("accept failed: %d\n", error);
+				return false;
+			}
+
+			Connection *connection = new Connection();
+			connection->socket = socket;
+			char host[48] = "?", port[16] = "?";
+			getnameinfo((sockaddr *)&address, addressLength, host, sizeof(host), port, sizeof(port),
+				NI_NUMERICHOST | NI_NUMERICSERV);
+			snprintf(connection->peer, sizeof(connection->peer), "%s:%s", host, port);
+			//pings and feedback are small and must not wait for the phone's ACK
+			int noDelay = 1;
+			setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+			if (!SetNonBlocking(socket) || !m_poller.add(socket, connection))
+			{
+				INGEST_LOG("%s: cannot poll the connection\n", connection->peer);
+				closesocket(socket);
+				delete connection;
+				continue;
+			}
+			m_connections.push_back(connection);
+			INGEST_LOG("%s connected (%d phones)\n", connection->peer, (int)m_connections.size());
+		}
+	}
+
+	void receive(Connection *connection, uint64_t recvTime)
+	{
+		size_t space;
+		char *recvbuf = connection->reader.prepare(space);
+		int iResult = recv(connection->socket, recvbuf, (int)space, 0);
+		if (iResult > 0)
+		{
+			connection->reader.received(iResult);
+			uint32_t ids = 0;
+			int count;
+			while ((count = connection->reader.next(m_frames, kMaxFramesPerRead)) > 0)
+			{
+				count = AnswerHellos(m_frames, count, m_publisher.wire_config(), connection->socket);
+				count = TakePongs(m_frames, count, connection->clock, recvTime, connection->peer);
+				if (count > 0)
+				{
+					m_publisher.publish_burst(m_frames, count, recvTime, ids, &connection->clock);
+				}
+			}
+			claim(connection, ids);
+			if (count < 0)
+			{
+				INGEST_LOG("%s: message too long\n", connection->peer);
+				disconnect(connection);
+			}
+			return;
+		}
+
+		if (iResult == 0)
+		{
+			INGEST_LOG("%s disconnected\n", connection->peer);
+		}
+		else if (WSAGetLastError() == WSAEWOULDBLOCK)
+		{
+			return;
+		}
+		else
+		{
+			INGEST_LOG("%s: recv failed: %d\n", connection->peer, WSAGetLastError());
+		}
+		disconnect(connection);
+	}
+
+	//makes the connection the owner of the ids it just sent
+	void claim(Connection *connection, uint32_t ids)
+	{
+		uint32_t added = ids & ~connection->phoneIds;
+		for (uint32_t id = 0; added != 0; id++, added >>= 1)
+		{
+			if ((added & 1) == 0)
+			{
+				continue;
+			}
+			Connection *previous = m_owners[id];
+			if (previous != NULL)
+			{
+				previous->phoneIds &= ~(1u << id);
+				INGEST_LOG("id %u moved from %s to %s\n", id, previous->peer, connection->peer);
+			}
+			else
+			{
+				INGEST_LOG("id %u is sent by %s\n", id, connection->peer);
+			}
+			m_owners[id] = connection;
+			connection->phoneIds |= 1u << id;
+		}
+	}
+
+	void disconnect(Connection *connection)
+	{
+		for (uint32_t id = 0; id < 32; id++)
+		{
+			if (m_owners[id] == connection)
+			{
+				m_owners[id] = NULL;
+			}
+		}
+		m_poller.remove(connection->socket);
+		closesocket(connection->socket);
+		for (size_t i = 0; i < m_connections.size(); i++)
+		{
+			if (m_connections[i] == connection)
+			{
+				m_connections.erase(m_connections.begin() + i);
+				break;
+			}
+		}
+		delete connection;
+	}
+
+	void forward_feedback()
+	{
+		const FeedbackEvent *ev;
+		while ((ev = m_layout->feedback.front()) != NULL)
+		{
+			if (ev->id < 32 && m_owners[ev->id] != NULL)
+			{
+				m_owners[ev->id]->feedback.append(*ev);
+			}
+			m_layout->feedback.pop();
+		}
+		for (size_t i = 0; i < m_connections.size(); i++)
+		{
+			m_connections[i]->feedback.flush(m_connections[i]->socket);
+		}
+	}
+
+	//phones that have sent poses are pinged until their clock is known,
+	//then now and then to follow its drift. A ping queued behind unsent
+	//feedback would time the backlog, so none goes out until it is sent.
+	void send_pings()
+	{
+		uint64_t now = GetTimestampUs();
+		for (size_t i = 0; i < m_connections.size(); i++)
+		{
+			Connection *connection = m_connections[i];
+			char ping[64];
+			int length = (connection->phoneIds != 0 && connection->feedback.length == 0)
+				? connection->clock.ping(now, ping, sizeof(ping)) : 0;
+			if (length > 0)
+			{
+				connection->feedback.append(ping, length);
+				connection->feedback.flush(connection->socket);
+			}
+		}
+	}
+
+	SharedLayout *m_layout;
+	PosePublisher &m_publisher;
+	SOCKET m_listenSocket = INVALID_SOCKET;
+	Poller m_poller;
+	FeedbackWatch m_feedbackWatch; //stopped before the poller closes
+	std::vector<Connection *> m_connections;
+	Connection *m_owners[32]; //phone id -> connection sending it
+	Frame m_frames[kMaxFramesPerRead];
+};
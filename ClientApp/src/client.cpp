@@ -5,154 +5,516 @@
 #define WIN32_LEAN_AND_MEAN
 #endif
 
+#ifdef _WIN32
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#endif
 #include <stdio.h>
 
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 #define _CRT_SECURE_NO_WARNINGS
+#ifdef _WIN32
 #include <windows.h>
 #include <conio.h>
+#endif
 
 #include "../headers/ShareMem.h"
+#include "../headers/SessionLog.h"
+#include "../headers/Ingest.h"
 
+#ifdef _WIN32
 #pragma comment(lib, "Ws2_32.lib")
+#endif
 
-int main()
+// Two producers would interleave their sequence numbers in the ring. The
+// one recorded in the layout is still running when its process exists and
+// its heartbeat moves; a crashed one or a reused pid fails one of the two.
+static bool ProducerIsRunning(const SharedLayout *layout)
 {
-	WSADATA wsaData;
-	int iResult;
+	uint32_t pid = layout->header.producerPid.load(std::memory_order_relaxed);
+	if (pid == 0 || pid == GetCurrentPid() || !IsProcessAlive(pid))
+	{
+		return false;
+	}
+	//PosePublisher::maintain advances it every few ms
+	uint64_t heartbeat = layout->header.heartbeat.load(std::memory_order_relaxed);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	return layout->header.heartbeat.load(std::memory_order_relaxed) != heartbeat;
+}
 
-	// Initialize Winsock
-	iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-	if (iResult != 0)
+// Opens the shared memory as the producer. Returns NULL on failure.
+static SharedLayout *AttachProducer(SharedMemory &comm, PosePublisher &publisher)
+{
+	if (!comm.is_open())
 	{
-		printf("WSAStartup failed: %d\n", iResult);
+		return NULL;
+	}
+
+	SharedLayout *layout = AttachSharedLayout(comm);
+	if (layout == NULL)
+	{
+		printf("incompatible shared memory layout\n");
+		return NULL;
+	}
+	if (ProducerIsRunning(layout))
+	{
+		printf("another client app (pid %u) is feeding the driver\n",
+			layout->header.producerPid.load(std::memory_order_relaxed));
+		return NULL;
+	}
+	publisher.attach(layout);
+	return layout;
+}
+
+// Publishes a recorded session to the driver instead of live phones.
+// Binary poses are decoded with the range they were recorded with; 'wire'
+// only applies to logs that do not store it. Messages go out in the bursts
+// they arrived in, with the same source and late filter as when recording.
+// speed 1 keeps the recorded gaps between messages, 4 plays four times as
+// fast, and 0 publishes as fast as the driver drains the ring.
+static int ReplaySession(const char *base, double speed, const WireConfig &wire)
+{
+	SessionLogReader reader;
+	if (!reader.open(base))
+	{
+		printf("cannot open %s.000.vrlog\n", base);
 		return 1;
 	}
 
-#define DEFAULT_PORT "27015"
+	WireConfig logWire = wire;
+	if (reader.position_range() > 0.0)
+	{
+		logWire.positionRange = reader.position_range();
+	}
 
-	struct addrinfo *result = NULL, *ptr = NULL, hints;
+	SharedMemory comm("pipe");
+	PosePublisher publisher;
+	publisher.set_wire_config(logWire);
+	SharedLayout *layout = AttachProducer(comm, publisher);
+	if (layout == NULL)
+	{
+		return -1;
+	}
+	SharedEvent spaceReady;
+	spaceReady.open("pipe_space", &layout->spaceReady);
+	uint32_t spaceSeen = 0;
+	bool draining = true;
 
-	ZeroMemory(&hints, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_flags = AI_PASSIVE;
-	// Resolve the local address and port to be used by the server
-	iResult = getaddrinfo(NULL, DEFAULT_PORT, &hints, &result);
-	if (iResult != 0)
+	SessionLogEntry entry;
+	Frame burst[kMaxFramesPerRead];
+	bool more = reader.next(entry);
+	bool dropLate = false;
+	uint64_t first = more ? entry.recvTime : 0, count = 0;
+	uint64_t start = GetTimestampUs();
+	while (more)
 	{
-		printf("getaddrinfo failed: %d\n", iResult);
-		WSACleanup();
-		return 1;
+		uint64_t recorded = entry.recvTime;
+		uint32_t source = entry.source;
+		bool burstDropLate = (entry.flags & kSessionLogDropLate) != 0;
+		int size = 0;
+		do
+		{
+			burst[size].data = entry.data;
+			burst[size].length = entry.length;
+			size++;
+			more = reader.next(entry);
+		} while (more && (entry.flags & kSessionLogBurstStart) == 0 && size < kMaxFramesPerRead);
+
+		if (speed > 0.0)
+		{
+			WaitUntilUs(start + (uint64_t)((recorded - first) / speed));
+		}
+		else if (draining && !publisher.has_space() && !WaitForWaitData(spaceReady, spaceSeen, 100))
+		{
+			printf("the driver is not draining the ring, no longer waiting for it\n");
+			draining = false;
+		}
+		if (count == 0 || burstDropLate != dropLate)
+		{
+			publisher.drop_late(burstDropLate);
+			dropLate = burstDropLate;
+		}
+		uint32_t ids = 0;
+		publisher.publish_burst(burst, size, GetTimestampUs(), ids, NULL, source);
+		count += size;
 	}
-	SOCKET ListenSocket = INVALID_SOCKET;
-	// Create a SOCKET for the server to listen for client connections
 
-	ListenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-	if (ListenSocket == INVALID_SOCKET)
+	double seconds = (GetTimestampUs() - start) / 1000000.0;
+	printf("replayed %llu messages in %.3f s (%.0f/s)\n",
+		(unsigned long long)count, seconds, seconds > 0.0 ? count / seconds : 0.0);
+	return 0;
+}
+
+// Finds the numbers of a JSON message, skipping those inside strings.
+static void CollectNumbers(const char *data, size_t length, std::vector<std::pair<const char *, size_t>> &numbers)
+{
+	const char *p = data, *end = data + length;
+	while (p < end)
 	{
-		printf("Error at socket(): %ld\n", WSAGetLastError());
-		freeaddrinfo(result);
-		WSACleanup();
-		return 1;
+		if (*p == '"')
+		{
+			for (p++; p < end && *p != '"'; p++)
+			{
+				if (*p == '\\')
+				{
+					p++;
+				}
+			}
+			p++;
+		}
+		else if (('0' <= *p && *p <= '9') || *p == '-')
+		{
+			const char *last = ScanNumberChars(p, end);
+			numbers.push_back(std::make_pair(p, (size_t)(last - p)));
+			p = last;
+		}
+		else
+		{
+			p++;
+		}
 	}
-	// Setup the TCP listening socket
-	iResult = bind(ListenSocket, result->ai_addr, (int)result->ai_addrlen);
-	if (iResult == SOCKET_ERROR)
+}
+
+// Times JSON decoding on the messages of a recorded session: the picojson
+// DOM the driver used to build, the streaming decoder, and the number
+// conversion on its own with ParseNumberFast and with strtod.
+static int BenchDecode(const char *base)
+{
+	SessionLogReader reader;
+	if (!reader.open(base))
 	{
-		printf("bind failed with error: %d\n", WSAGetLastError());
-		freeaddrinfo(result);
-		closesocket(ListenSocket);
-		WSACleanup();
+		printf("cannot open %s.000.vrlog\n", base);
 		return 1;
 	}
-	freeaddrinfo(result);
-	printf("socket: port is 27015");
-	if (listen(ListenSocket, SOMAXCONN) == SOCKET_ERROR)
+
+	//copied out, the reader unmaps finished segments
+	std::string text;
+	std::vector<std::pair<size_t, size_t>> messages;
+	SessionLogEntry entry;
+	while (reader.next(entry))
 	{
-		printf("Listen failed with error: %ld\n", WSAGetLastError());
-		closesocket(ListenSocket);
-		WSACleanup();
+		if (!IsWirePacket(entry.data, entry.length))
+		{
+			messages.push_back(std::make_pair(text.size(), entry.length));
+			text.append(entry.data, entry.length);
+		}
+	}
+	if (messages.empty())
+	{
+		printf("%s has no JSON messages\n", base);
 		return 1;
 	}
-	SOCKET ClientSocket;
-	ClientSocket = INVALID_SOCKET;
+	std::vector<std::pair<const char *, size_t>> numbers;
+	for (size_t i = 0; i < messages.size(); i++)
+	{
+		CollectNumbers(text.data() + messages[i].first, messages[i].second, numbers);
+	}
 
-	// Accept a client socket
-	ClientSocket = accept(ListenSocket, NULL, NULL);
-	if (ClientSocket == INVALID_SOCKET)
+	//enough passes for about a million messages
+	size_t passes = 1000000 / messages.size() + 1;
+	volatile double sink = 0.0; //keeps the work from being optimised away
+	uint64_t start = GetTimestampUs();
+	for (size_t pass = 0; pass < passes; pass++)
 	{
-		printf("accept failed: %d\n", WSAGetLastError());
-		closesocket(ListenSocket);
-		WSACleanup();
-		return 1;
+		for (size_t i = 0; i < messages.size(); i++)
+		{
+			const char *message = text.data() + messages[i].first;
+			picojson::value json;
+			std::string err;
+			picojson::parse(json, message, message + messages[i].second, &err);
+			sink += json.is<picojson::object>() ? 1.0 : 0.0;
+		}
 	}
+	uint64_t dom = GetTimestampUs() - start;
 
-#define DEFAULT_BUFLEN 1024
+	start = GetTimestampUs();
+	size_t decoded = 0;
+	for (size_t pass = 0; pass < passes; pass++)
+	{
+		for (size_t i = 0; i < messages.size(); i++)
+		{
+			PosePacket packet;
+			uint32_t phoneSequence;
+			if (DecodePosePacket(text.data() + messages[i].first, messages[i].second, packet, &phoneSequence))
+			{
+				sink += packet.trigger;
+				decoded++;
+			}
+		}
+	}
+	uint64_t streaming = GetTimestampUs() - start;
 
-	char recvbuf[DEFAULT_BUFLEN];
-	int iSendResult;
-	int recvbuflen = DEFAULT_BUFLEN;
+	size_t numberPasses = 10000000 / (numbers.size() + 1) + 1;
+	start = GetTimestampUs();
+	for (size_t pass = 0; pass < numberPasses; pass++)
+	{
+		for (size_t i = 0; i < numbers.size(); i++)
+		{
+			double value = 0.0;
+			JsonParseNumberStrtod(numbers[i].first, numbers[i].second, value);
+			sink += value;
+		}
+	}
+	uint64_t strtodTime = GetTimestampUs() - start;
 
-	std::cout << "start\n";
+	start = GetTimestampUs();
+	for (size_t pass = 0; pass < numberPasses; pass++)
+	{
+		for (size_t i = 0; i < numbers.size(); i++)
+		{
+			double value = 0.0;
+			if (!ParseNumberFast(numbers[i].first, numbers[i].second, value))
+			{
+				JsonParseNumberStrtod(numbers[i].first, numbers[i].second, value);
+			}
+			sink += value;
+		}
+	}
+	uint64_t fastTime = GetTimestampUs() - start;
 
-	SharedMemory comm("pipe");
-	if (!comm.is_open())
+	//the fast path has to give strtod's double, bit for bit
+	size_t fast = 0, mismatches = 0;
+	for (size_t i = 0; i < numbers.size(); i++)
 	{
-		return -1;
+		double a = 0.0, b = 0.0;
+		bool parsed = JsonParseNumberStrtod(numbers[i].first, numbers[i].second, b);
+		if (ParseNumberFast(numbers[i].first, numbers[i].second, a))
+		{
+			fast++;
+			if (!parsed || memcmp(&a, &b, sizeof(a)) != 0)
+			{
+				mismatches++;
+				printf("mismatch: %.*s\n", (int)numbers[i].second, numbers[i].first);
+			}
+		}
+	}
+
+	double messageCount = (double)passes * messages.size();
+	double numberCount = (double)numberPasses * numbers.size();
+	printf("%zu JSON messages (%zu decode), %zu numbers\n",
+		messages.size(), decoded / passes, numbers.size());
+	printf("picojson DOM      %8.0f ns/message\n", dom * 1000.0 / messageCount);
+	printf("streaming decode  %8.0f ns/message\n", streaming * 1000.0 / messageCount);
+	printf("numbers, strtod   %8.1f ns/number\n", numbers.empty() ? 0.0 : strtodTime * 1000.0 / numberCount);
+	printf("numbers, fast     %8.1f ns/number (%.1f%% without strtod, %zu mismatches)\n",
+		numbers.empty() ? 0.0 : fastTime * 1000.0 / numberCount,
+		numbers.empty() ? 0.0 : 100.0 * fast / numbers.size(), mismatches);
+	return mismatches > 0 ? 1 : 0;
+}
+
+// Attaches to the running session without creating or modifying anything.
+static SharedLayout *AttachViewer(SharedMemory &comm)
+{
+	comm.open("pipe", true);
+	SharedLayout *layout = AttachSharedLayout(comm);
+	if (layout == NULL)
+	{
+		printf("no compatible shared memory found\n");
+	}
+	return layout;
+}
+
+// Prints the latency histograms recorded by the running client and driver.
+static int DumpLatency()
+{
+	SharedMemory comm;
+	SharedLayout *layout = AttachViewer(comm);
+	if (layout == NULL)
+	{
+		return 1;
 	}
 
-	char *SharedRam = (char *)comm.get_pointer();
+	char report[2048];
+	FormatLatencyPage(layout->latency, report, sizeof(report));
+	printf("%s", report);
+	return 0;
+}
+
+// Reads the StatsPage counters that ViewStats shows.
+static void ReadStatsCounters(const StatsPage &stats, uint64_t counters[8])
+{
+	counters[0] = stats.packetsReceived.load(std::memory_order_relaxed);
+	counters[1] = stats.bytesReceived.load(std::memory_order_relaxed);
+	counters[2] = stats.packetsDropped.load(std::memory_order_relaxed);
+	counters[3] = stats.parseFailures.load(std::memory_order_relaxed);
+	counters[4] = stats.packetsLate.load(std::memory_order_relaxed);
+	counters[5] = stats.packetsLost.load(std::memory_order_relaxed);
+	counters[6] = stats.packetsConsumed.load(std::memory_order_relaxed);
+	counters[7] = stats.framesRun.load(std::memory_order_relaxed);
+}
+
+// Prints the IPC counters as they are, then their rates once a second until
+// killed. The rates only come from two snapshots of this viewer.
+static int ViewStats()
+{
+	SharedMemory comm;
+	SharedLayout *layout = AttachViewer(comm);
+	if (layout == NULL)
+	{
+		return 1;
+	}
 
-	SharedRam[0] = '\0';
+	const StatsPage &stats = layout->stats;
+	uint64_t prev[8];
+	ReadStatsCounters(stats, prev);
+	uint64_t prevTime = GetTimestampUs();
+	printf("totals: %llu received, %.1f KB, %llu dropped, %llu bad, %llu late, %llu lost, %llu consumed, %llu frames\n",
+		(unsigned long long)prev[0], prev[1] / 1024.0, (unsigned long long)prev[2], (unsigned long long)prev[3],
+		(unsigned long long)prev[4], (unsigned long long)prev[5], (unsigned long long)prev[6], (unsigned long long)prev[7]);
+	printf("%10s %10s %8s %8s %8s %8s %10s %10s %8s %10s %10s\n",
+		"recv/s", "KB/s", "drop/s", "bad/s", "late/s", "lost/s", "consume/s", "frames/s", "backlog", "last seq", "heartbeat");
 	while (true)
 	{
-		//WaitForWaitData(SharedRam); //データ待ちになるまで待つ
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		uint64_t now[8];
+		ReadStatsCounters(stats, now);
+		uint64_t nowTime = GetTimestampUs();
+		double seconds = (nowTime - prevTime) / 1000000.0;
+		double rate[8];
+		for (int i = 0; i < 8; i++)
+		{
+			//a new client app starts the counters over
+			uint64_t delta = now[i] >= prev[i] ? now[i] - prev[i] : now[i];
+			rate[i] = delta / seconds;
+		}
+		uint32_t lastSequence = stats.lastSequence.load(std::memory_order_relaxed);
+		uint32_t lastConsumed = stats.lastConsumedSequence.load(std::memory_order_relaxed);
+		printf("%10.0f %10.1f %8.0f %8.0f %8.0f %8.0f %10.0f %10.0f %8u %10u %10llu\n",
+			rate[0], rate[1] / 1024.0, rate[2], rate[3], rate[4], rate[5], rate[6], rate[7],
+			lastSequence - lastConsumed,
+			lastSequence,
+			(unsigned long long)layout->header.heartbeat.load(std::memory_order_relaxed));
+		memcpy(prev, now, sizeof(prev));
+		prevTime = nowTime;
+	}
+	return 0;
+}
 
-		char recvbuf[DEFAULT_BUFLEN] = {};
-		iResult = recv(ClientSocket, recvbuf, recvbuflen, 0);
-		if (iResult > 0)
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "--latency") == 0)
+	{
+		return DumpLatency();
+	}
+	if (argc > 1 && strcmp(argv[1], "--stats") == 0)
+	{
+		return ViewStats();
+	}
+	if (argc > 2 && strcmp(argv[1], "--bench-decode") == 0)
+	{
+		return BenchDecode(argv[2]);
+	}
+	bool udp = false;
+	WireConfig wire;
+	const char *recordPath = NULL;
+	const char *replayPath = NULL;
+	double replaySpeed = 1.0;
+	size_t recordSize = kSessionLogDefaultSegment;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--udp") == 0)
 		{
-			printf("Bytes received: %d,%d\n", iResult, (unsigned)strlen(recvbuf));
-			//recvbuf[iResult] = '\0';
+			udp = true;
 		}
-		else if (iResult == 0)
+		else if (strcmp(argv[i], "--range") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0.0)
 		{
-			printf("Connection closing...\n");
-			break;
+			wire.positionRange = atof(argv[++i]);
 		}
-		else
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
 		{
-			printf("recv failed: %d\n", WSAGetLastError());
-			closesocket(ClientSocket);
-			WSACleanup();
-			return 1;
+			recordPath = argv[++i];
 		}
-
-		if (SharedRam[0] == 'x')
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+		{
+			replayPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0.0)
+		{
+			replaySpeed = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--max") == 0)
 		{
-			comm.print(recvbuf);
+			replaySpeed = 0.0;
 		}
-		printf("->%s\n", recvbuf);
+		else if (strcmp(argv[i], "--record-size") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+		{
+			recordSize = (size_t)atoi(argv[++i]) * 1024 * 1024;
+		}
+	}
+
+	if (replayPath != NULL)
+	{
+		return ReplaySession(replayPath, replaySpeed, wire);
+	}
+
+	WSADATA wsaData;
+	int iResult;
+
+	// Initialize Winsock
+	iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (iResult != 0)
+	{
+		printf("WSAStartup failed: %d\n", iResult);
+		return 1;
 	}
 
-	// shutdown the connection since we're done
-	iResult = shutdown(ClientSocket, SD_SEND);
-	if (iResult == SOCKET_ERROR)
+#define DEFAULT_PORT "27015"
+
+	SOCKET ListenSocket = OpenIngestSocket(DEFAULT_PORT, udp);
+	if (ListenSocket == INVALID_SOCKET)
 	{
-		printf("shutdown failed with error: %d\n", WSAGetLastError());
-		closesocket(ClientSocket);
 		WSACleanup();
 		return 1;
 	}
+	printf("socket: port is 27015 (%s)\n", udp ? "udp" : "tcp");
+
+	SharedMemory comm("pipe");
+	PosePublisher publisher;
+	publisher.set_wire_config(wire);
+	SharedLayout *layout = AttachProducer(comm, publisher);
+	if (layout == NULL)
+	{
+		closesocket(ListenSocket);
+		WSACleanup();
+		return -1;
+	}
+
+	SessionRecorder recorder;
+	if (recordPath != NULL)
+	{
+		if (!recorder.open(recordPath, recordSize))
+		{
+			closesocket(ListenSocket);
+			WSACleanup();
+			return 1;
+		}
+		publisher.record_to(&recorder);
+		printf("recording to %s.*.vrlog\n", recordPath);
+	}
+
+	//the driver bumps it after queueing haptics or status for the phones
+	SharedEvent feedbackReady;
+	feedbackReady.open("pipe_feedback", &layout->feedbackReady);
+
+	std::cout << "start\n";
+	if (udp)
+	{
+		iResult = ReceiveDatagrams(ListenSocket, layout, publisher, NULL, &feedbackReady);
+	}
+	else
+	{
+		PoseServer server(layout, publisher);
+		iResult = server.run(ListenSocket, NULL, &feedbackReady);
+	}
 
 	// cleanup
-	closesocket(ClientSocket);
+	closesocket(ListenSocket);
 	WSACleanup();
 
-	return 0;
+	return iResult;
 }
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FAST_NUMBER_SSE2 1
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+//----------number scan-----------
+
+// The characters a JSON number can be made of. A run of them is handed to
+// the parser as a whole, the way picojson's _parse_number collects it.
+inline bool IsNumberChar(int ch)
+{
+	return ('0' <= ch && ch <= '9') || ch == '+' || ch == '-' || ch == 'e' || ch == 'E' || ch == '.';
+}
+
+// Returns the end of the run of number characters starting at p.
+// Sixteen bytes at a time where SSE2 is available.
+inline const char* ScanNumberChars(const char* p, const char* end)
+{
+#ifdef FAST_NUMBER_SSE2
+	const __m128i belowZero = _mm_set1_epi8('0' - 1);
+	const __m128i aboveNine = _mm_set1_epi8('9' + 1);
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*)p);
+		//bytes over 0x7f are negative and fail the digit test
+		__m128i match = _mm_and_si128(_mm_cmpgt_epi8(chunk, belowZero), _mm_cmplt_epi8(chunk, aboveNine));
+		match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('.')));
+		match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('-')));
+		match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('+')));
+		match = _mm_or_si128(match, _mm_cmpeq_epi8(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), _mm_set1_epi8('e')));
+		unsigned stop = ~(unsigned)_mm_movemask_epi8(match) & 0xffff;
+		if (stop != 0) {
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, stop);
+			return p + index;
+#else
+			return p + __builtin_ctz(stop);
+#endif
+		}
+		p += 16;
+	}
+#endif
+	while (p < end && IsNumberChar(*p & 0xff)) {
+		p++;
+	}
+	return p;
+}
+
+//----------number parse-----------
+
+// Correctly rounded decimal to double without strtod, after Clinger's fast
+// path and the Eisel-Lemire algorithm (Lemire, "Number Parsing at a Gigabyte
+// per Second", 2021). A phone sample is about ten numbers of up to 17
+// digits, all of which these cover. Anything else - more than 19 significant
+// digits, exponents outside the table, subnormals, infinities, or text
+// strtod would read differently - is left to the caller's strtod.
+static const int kFastNumberMinPower = -64;
+static const int kFastNumberMaxPower = 32;
+
+//5^q for q in [kFastNumberMinPower, kFastNumberMaxPower], normalised so the
+//top bit is set, in 128 bits (high word first)
+static const uint64_t kFastNumberPowersOfFive[kFastNumberMaxPower - kFastNumberMinPower + 1][2] = {
+	{ 0xa87fea27a539e9a5ull, 0x3f2398d747b36224ull }, //5^-64
+	{ 0xd29fe4b18e88640eull, 0x8eec7f0d19a03aadull }, //5^-63
+	{ 0x83a3eeeef9153e89ull, 0x1953cf68300424acull }, //5^-62
+	{ 0xa48ceaaab75a8e2bull, 0x5fa8c3423c052dd7ull }, //5^-61
+	{ 0xcdb02555653131b6ull, 0x3792f412cb06794dull }, //5^-60
+	{ 0x808e17555f3ebf11ull, 0xe2bbd88bbee40bd0ull }, //5^-59
+	{ 0xa0b19d2ab70e6ed6ull, 0x5b6aceaeae9d0ec4ull }, //5^-58
+	{ 0xc8de047564d20a8bull, 0xf245825a5a445275ull }, //5^-57
+	{ 0xfb158592be068d2eull, 0xeed6e2f0f0d56712ull }, //5^-56
+	{ 0x9ced737bb6c4183dull, 0x55464dd69685606bull }, //5^-55
+	{ 0xc428d05aa4751e4cull, 0xaa97e14c3c26b886ull }, //5^-54
+	{ 0xf53304714d9265dfull, 0xd53dd99f4b3066a8ull }, //5^-53
+	{ 0x993fe2c6d07b7fabull, 0xe546a8038efe4029ull }, //5^-52
+	{ 0xbf8fdb78849a5f96ull, 0xde98520472bdd033ull }, //5^-51
+	{ 0xef73d256a5c0f77cull, 0x963e66858f6d4440ull }, //5^-50
+	{ 0x95a8637627989aadull, 0xdde7001379a44aa8ull }, //5^-49
+	{ 0xbb127c53b17ec159ull, 0x5560c018580d5d52ull }, //5^-48
+	{ 0xe9d71b689dde71afull, 0xaab8f01e6e10b4a6ull }, //5^-47
+	{ 0x9226712162ab070dull, 0xcab3961304ca70e8ull }, //5^-46
+	{ 0xb6b00d69bb55c8d1ull, 0x3d607b97c5fd0d22ull }, //5^-45
+	{ 0xe45c10c42a2b3b05ull, 0x8cb89a7db77c506aull }, //5^-44
+	{ 0x8eb98a7a9a5b04e3ull, 0x77f3608e92adb242ull }, //5^-43
+	{ 0xb267ed1940f1c61cull, 0x55f038b237591ed3ull }, //5^-42
+	{ 0xdf01e85f912e37a3ull, 0x6b6c46dec52f6688ull }, //5^-41
+	{ 0x8b61313bbabce2c6ull, 0x2323ac4b3b3da015ull }, //5^-40
+	{ 0xae397d8aa96c1b77ull, 0xabec975e0a0d081aull }, //5^-39
+	{ 0xd9c7dced53c72255ull, 0x96e7bd358c904a21ull }, //5^-38
+	{ 0x881cea14545c7575ull, 0x7e50d64177da2e54ull }, //5^-37
+	{ 0xaa242499697392d2ull, 0xdde50bd1d5d0b9e9ull }, //5^-36
+	{ 0xd4ad2dbfc3d07787ull, 0x955e4ec64b44e864ull }, //5^-35
+	{ 0x84ec3c97da624ab4ull, 0xbd5af13bef0b113eull }, //5^-34
+	{ 0xa6274bbdd0fadd61ull, 0xecb1ad8aeacdd58eull }, //5^-33
+	{ 0xcfb11ead453994baull, 0x67de18eda5814af2ull }, //5^-32
+	{ 0x81ceb32c4b43fcf4ull, 0x80eacf948770ced7ull }, //5^-31
+	{ 0xa2425ff75e14fc31ull, 0xa1258379a94d028dull }, //5^-30
+	{ 0xcad2f7f5359a3b3eull, 0x096ee45813a04330ull }, //5^-29
+	{ 0xfd87b5f28300ca0dull, 0x8bca9d6e188853fcull }, //5^-28
+	{ 0x9e74d1b791e07e48ull, 0x775ea264cf55347eull }, //5^-27
+	{ 0xc612062576589ddaull, 0x95364afe032a819eull }, //5^-26
+	{ 0xf79687aed3eec551ull, 0x3a83ddbd83f52205ull }, //5^-25
+	{ 0x9abe14cd44753b52ull, 0xc4926a9672793543ull }, //5^-24
+	{ 0xc16d9a0095928a27ull, 0x75b7053c0f178294ull }, //5^-23
+	{ 0xf1c90080baf72cb1ull, 0x5324c68b12dd6339ull }, //5^-22
+	{ 0x971da05074da7beeull, 0xd3f6fc16ebca5e04ull }, //5^-21
+	{ 0xbce5086492111aeaull, 0x88f4bb1ca6bcf585ull }, //5^-20
+	{ 0xec1e4a7db69561a5ull, 0x2b31e9e3d06c32e6ull }, //5^-19
+	{ 0x9392ee8e921d5d07ull, 0x3aff322e62439fd0ull }, //5^-18
+	{ 0xb877aa3236a4b449ull, 0x09befeb9fad487c3ull }, //5^-17
+	{ 0xe69594bec44de15bull, 0x4c2ebe687989a9b4ull }, //5^-16
+	{ 0x901d7cf73ab0acd9ull, 0x0f9d37014bf60a11ull }, //5^-15
+	{ 0xb424dc35095cd80full, 0x538484c19ef38c95ull }, //5^-14
+	{ 0xe12e13424bb40e13ull, 0x2865a5f206b06fbaull }, //5^-13
+	{ 0x8cbccc096f5088cbull, 0xf93f87b7442e45d4ull }, //5^-12
+	{ 0xafebff0bcb24aafeull, 0xf78f69a51539d749ull }, //5^-11
+	{ 0xdbe6fecebdedd5beull, 0xb573440e5a884d1cull }, //5^-10
+	{ 0x89705f4136b4a597ull, 0x31680a88f8953031ull }, //5^-9
+	{ 0xabcc77118461cefcull, 0xfdc20d2b36ba7c3eull }, //5^-8
+	{ 0xd6bf94d5e57a42bcull, 0x3d32907604691b4dull }, //5^-7
+	{ 0x8637bd05af6c69b5ull, 0xa63f9a49c2c1b110ull }, //5^-6
+	{ 0xa7c5ac471b478423ull, 0x0fcf80dc33721d54ull }, //5^-5
+	{ 0xd1b71758e219652bull, 0xd3c36113404ea4a9ull }, //5^-4
+	{ 0x83126e978d4fdf3bull, 0x645a1cac083126eaull }, //5^-3
+	{ 0xa3d70a3d70a3d70aull, 0x3d70a3d70a3d70a4ull }, //5^-2
+	{ 0xccccccccccccccccull, 0xcccccccccccccccdull }, //5^-1
+	{ 0x8000000000000000ull, 0x0000000000000000ull }, //5^0
+	{ 0xa000000000000000ull, 0x0000000000000000ull }, //5^1
+	{ 0xc800000000000000ull, 0x0000000000000000ull }, //5^2
+	{ 0xfa00000000000000ull, 0x0000000000000000ull }, //5^3
+	{ 0x9c40000000000000ull, 0x0000000000000000ull }, //5^4
+	{ 0xc350000000000000ull, 0x0000000000000000ull }, //5^5
+	{ 0xf424000000000000ull, 0x0000000000000000ull }, //5^6
+	{ 0x9896800000000000ull, 0x0000000000000000ull }, //5^7
+	{ 0xbebc200000000000ull, 0x0000000000000000ull }, //5^8
+	{ 0xee6b280000000000ull, 0x0000000000000000ull }, //5^9
+	{ 0x9502f90000000000ull, 0x0000000000000000ull }, //5^10
+	{ 0xba43b74000000000ull, 0x0000000000000000ull }, //5^11
+	{ 0xe8d4a51000000000ull, 0x0000000000000000ull }, //5^12
+	{ 0x9184e72a00000000ull, 0x0000000000000000ull }, //5^13
+	{ 0xb5e620f480000000ull, 0x0000000000000000ull }, //5^14
+	{ 0xe35fa931a0000000ull, 0x0000000000000000ull }, //5^15
+	{ 0x8e1bc9bf04000000ull, 0x0000000000000000ull }, //5^16
+	{ 0xb1a2bc2ec5000000ull, 0x0000000000000000ull }, //5^17
+	{ 0xde0b6b3a76400000ull, 0x0000000000000000ull }, //5^18
+	{ 0x8ac7230489e80000ull, 0x0000000000000000ull }, //5^19
+	{ 0xad78ebc5ac620000ull, 0x0000000000000000ull }, //5^20
+	{ 0xd8d726b7177a8000ull, 0x0000000000000000ull }, //5^21
+	{ 0x878678326eac9000ull, 0x0000000000000000ull }, //5^22
+	{ 0xa968163f0a57b400ull, 0x0000000000000000ull }, //5^23
+	{ 0xd3c21bcecceda100ull, 0x0000000000000000ull }, //5^24
+	{ 0x84595161401484a0ull, 0x0000000000000000ull }, //5^25
+	{ 0xa56fa5b99019a5c8ull, 0x0000000000000000ull }, //5^26
+	{ 0xcecb8f27f4200f3aull, 0x0000000000000000ull }, //5^27
+	{ 0x813f3978f8940984ull, 0x4000000000000000ull }, //5^28
+	{ 0xa18f07d736b90be5ull, 0x5000000000000000ull }, //5^29
+	{ 0xc9f2c9cd04674edeull, 0xa400000000000000ull }, //5^30
+	{ 0xfc6f7c4045812296ull, 0x4d00000000000000ull }, //5^31
+	{ 0x9dc5ada82b70b59dull, 0xf020000000000000ull }, //5^32
+};
+
+inline void FastNumberMultiply(uint64_t a, uint64_t b, uint64_t& high, uint64_t& low)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 product = (unsigned __int128)a * b;
+	high = (uint64_t)(product >> 64);
+	low = (uint64_t)product;
+#elif defined(_MSC_VER) && defined(_M_X64)
+	low = _umul128(a, b, &high);
+#else
+	uint64_t aLow = (uint32_t)a, aHigh = a >> 32, bLow = (uint32_t)b, bHigh = b >> 32;
+	uint64_t ll = aLow * bLow, lh = aLow * bHigh, hl = aHigh * bLow, hh = aHigh * bHigh;
+	uint64_t middle = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+	high = hh + (lh >> 32) + (hl >> 32) + (middle >> 32);
+	low = (middle << 32) | (uint32_t)ll;
+#endif
+}
+
+inline int FastNumberLeadingZeros(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - (int)index;
+#elif defined(__GNUC__)
+	return __builtin_clzll(x);
+#else
+	int count = 0;
+	while ((x & 0x8000000000000000ull) == 0) {
+		x <<= 1;
+		count++;
+	}
+	return count;
+#endif
+}
+
+// w * 10^q for w != 0. Returns false when the table does not reach q or the
+// result would be subnormal or infinite.
+inline bool FastNumberEiselLemire(uint64_t w, int q, double& out)
+{
+	if (q < kFastNumberMinPower || q > kFastNumberMaxPower) {
+		return false;
+	}
+	int leadingZeros = FastNumberLeadingZeros(w);
+	w <<= leadingZeros;
+
+	//the top 55 bits of w * 5^q; a second word only matters when the bits
+	//below them are all ones
+	const uint64_t* power = kFastNumberPowersOfFive[q - kFastNumberMinPower];
+	uint64_t high, low;
+	FastNumberMultiply(w, power[0], high, low);
+	const uint64_t precisionMask = 0xffffffffffffffffull >> 55;
+	if ((high & precisionMask) == precisionMask) {
+		uint64_t secondHigh, secondLow;
+		FastNumberMultiply(w, power[1], secondHigh, secondLow);
+		low += secondHigh;
+		if (secondHigh > low) {
+			high++;
+		}
+		if ((high & precisionMask) == precisionMask && low == 0xffffffffffffffffull) {
+			return false; //cannot tell which way it rounds
+		}
+	}
+
+	int upperBit = (int)(high >> 63);
+	int shift = upperBit + 64 - 52 - 3;
+	uint64_t mantissa = high >> shift;
+	//floor(log2(10^q)) + 63, plus the exponent bias
+	int exponent = (((152170 + 65536) * q) >> 16) + 63 + upperBit - leadingZeros + 1023;
+	if (exponent <= 0) {
+		return false;
+	}
+	//exactly halfway between two doubles: round to even. Only products of
+	//small powers of five can be exact.
+	if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == high) {
+		mantissa &= ~(uint64_t)1;
+	}
+	mantissa += mantissa & 1;
+	mantissa >>= 1;
+	if (mantissa >= ((uint64_t)2 << 52)) {
+		mantissa = (uint64_t)1 << 52;
+		exponent++;
+	}
+	if (exponent >= 0x7ff) {
+		return false;
+	}
+	uint64_t bits = (mantissa & ~((uint64_t)1 << 52)) | ((uint64_t)exponent << 52);
+	memcpy(&out, &bits, sizeof(out));
+	return true;
+}
+
+// Parses text[0, length) as a whole, "-12.5e3" style. Returns false when it
+// has to be left to strtod, including everything that is not a number.
+inline bool ParseNumberFast(const char* text, size_t length, double& out)
+{
+	static const double kPowersOfTen[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	const char* p = text;
+	const char* end = text + length;
+	bool negative = (p < end && *p == '-');
+	if (negative) {
+		p++;
+	}
+
+	//up to 19 significant digits fit in w; the decimal point moves q
+	uint64_t w = 0;
+	int digits = 0, q = 0;
+	const char* start = p;
+	while (p < end && '0' <= *p && *p <= '9') {
+		if (digits > 0 || *p != '0') {
+			w = w * 10 + (uint64_t)(*p - '0');
+			digits++;
+		}
+		p++;
+	}
+	if (p == start) {
+		return false;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		const char* fraction = p;
+		while (p < end && '0' <= *p && *p <= '9') {
+			if (digits > 0 || *p != '0') {
+				w = w * 10 + (uint64_t)(*p - '0');
+				digits++;
+			}
+			p++;
+		}
+		if (p == fraction) {
+			return false;
+		}
+		q = -(int)(p - fraction);
+	}
+	if (digits > 19) {
+		return false;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool negativeExponent = (p < end && *p == '-');
+		if (p < end && (*p == '-' || *p == '+')) {
+			p++;
+		}
+		const char* exponentStart = p;
+		int exponent = 0;
+		while (p < end && '0' <= *p && *p <= '9') {
+			if (exponent < 10000) {
+				exponent = exponent * 10 + (*p - '0');
+			}
+			p++;
+		}
+		if (p == exponentStart) {
+			return false;
+		}
+		q += negativeExponent ? -exponent : exponent;
+	}
+	if (p != end) {
+		return false;
+	}
+
+	double value;
+	if (w == 0) {
+		value = 0.0;
+	}
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+	else if (w <= ((uint64_t)1 << 53) && -22 <= q && q <= 22) {
+		//both w and 10^|q| are exact doubles, so one rounding
+		value = (double)w;
+		value = (q < 0) ? value / kPowersOfTen[-q] : value * kPowersOfTen[q];
+	}
+#endif
+	else if (!FastNumberEiselLemire(w, q, value)) {
+		return false;
+	}
+	out = negative ? -value : value;
+	return true;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+//----------clock-----------
+
+// Monotonic clock shared by both processes [us]
+inline uint64_t GetTimestampUs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sleeps most of the way and spins the rest, for sub-millisecond deadlines.
+inline void WaitUntilUs(uint64_t dueTime)
+{
+	while (true) {
+		uint64_t now = GetTimestampUs();
+		if (now >= dueTime) {
+			return;
+		}
+		if (dueTime - now > 2000) {
+			std::this_thread::sleep_for(std::chrono::microseconds(dueTime - now - 1000));
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+//----------histogram-----------
+
+// Log-linear (HDR style) latency histogram in microseconds. Values below 32us
+// get their own bucket, above that every power of two is split into 16
+// sub-buckets, so the relative error stays under ~6% up to ~16s.
+// Counters are relaxed atomics: the histogram lives in the shared mapping and
+// can be read by another process while it is being recorded.
+static const uint32_t kLatencyLinearBuckets = 32;
+static const uint32_t kLatencySubBuckets = 16;
+static const uint32_t kLatencyMaxExponent = 23;
+static const uint32_t kLatencyBucketCount =
+	kLatencyLinearBuckets + (kLatencyMaxExponent - 4) * kLatencySubBuckets;
+
+struct LatencyHistogram {
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> max;
+	std::atomic<uint32_t> buckets[kLatencyBucketCount];
+
+	static uint32_t bucket_of(uint64_t us)
+	{
+		if (us < kLatencyLinearBuckets) {
+			return (uint32_t)us;
+		}
+		uint32_t msb = 63;
+		while ((us >> msb) == 0) {
+			msb--;
+		}
+		if (msb > kLatencyMaxExponent) {
+			return kLatencyBucketCount - 1;
+		}
+		uint32_t sub = (uint32_t)(us >> (msb - 4)) & (kLatencySubBuckets - 1);
+		return kLatencyLinearBuckets + (msb - 5) * kLatencySubBuckets + sub;
+	}
+
+	//largest value that falls into the bucket
+	static uint64_t bucket_upper(uint32_t bucket)
+	{
+		if (bucket < kLatencyLinearBuckets) {
+			return bucket;
+		}
+		uint32_t msb = (bucket - kLatencyLinearBuckets) / kLatencySubBuckets + 5;
+		uint64_t sub = (bucket - kLatencyLinearBuckets) % kLatencySubBuckets;
+		return ((uint64_t)1 << msb) + ((sub + 1) << (msb - 4)) - 1;
+	}
+
+	void record(uint64_t us)
+	{
+		buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		uint64_t seen = max.load(std::memory_order_relaxed);
+		while (us > seen && !max.compare_exchange_weak(seen, us, std::memory_order_relaxed)) {
+		}
+	}
+
+	//records end - start, ignoring samples whose start stamp is missing or later
+	void record_span(uint64_t start, uint64_t end)
+	{
+		if (start != 0 && end >= start) {
+			record(end - start);
+		}
+	}
+
+	//value below which 'fraction' of the samples fall
+	uint64_t percentile(double fraction) const
+	{
+		uint64_t total = count.load(std::memory_order_relaxed);
+		if (total == 0) {
+			return 0;
+		}
+		uint64_t rank = (uint64_t)(fraction * (double)total);
+		uint64_t seen = 0;
+		uint64_t largest = max.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < kLatencyBucketCount; i++) {
+			seen += buckets[i].load(std::memory_order_relaxed);
+			if (seen > rank) {
+				//the bucket's bound can lie above every sample in it
+				uint64_t upper = bucket_upper(i);
+				return upper < largest ? upper : largest;
+			}
+		}
+		return largest;
+	}
+
+	//forgets every sample; one racing with it may be half counted
+	void reset()
+	{
+		for (uint32_t i = 0; i < kLatencyBucketCount; i++) {
+			buckets[i].store(0, std::memory_order_relaxed);
+		}
+		count.store(0, std::memory_order_relaxed);
+		max.store(0, std::memory_order_relaxed);
+	}
+};
+
+//----------pipeline stages-----------
+
+// phone send -> ClientApp recv -> shared memory publish -> RunFrame consume
+// -> TrackedDevicePoseUpdated. The first span compares the phone's clock with
+// ours, so it is only meaningful once both are in the same domain.
+enum LatencyStage {
+	LatencyStage_SendToRecv,
+	LatencyStage_RecvToPublish,
+	LatencyStage_PublishToConsume,
+	LatencyStage_ConsumeToSubmit,
+	LatencyStage_RecvToSubmit,
+	LatencyStage_Count,
+};
+
+static const char* const kLatencyStageNames[LatencyStage_Count] = {
+	"send->recv",
+	"recv->publish",
+	"publish->consume",
+	"consume->submit",
+	"recv->submit",
+};
+
+struct LatencyPage {
+	LatencyHistogram stages[LatencyStage_Count];
+};
+
+// Writes a p50/p99/max table of all stages into buf, like snprintf.
+inline int FormatLatencyPage(const LatencyPage& page, char* buf, size_t size)
+{
+	int written = snprintf(buf, size, "%-18s %10s %8s %8s %8s\n", "stage [us]", "count", "p50", "p99", "max");
+	for (int i = 0; i < LatencyStage_Count && written >= 0 && (size_t)written < size; i++) {
+		const LatencyHistogram& h = page.stages[i];
+		written += snprintf(buf + written, size - written, "%-18s %10llu %8llu %8llu %8llu\n",
+			kLatencyStageNames[i],
+			(unsigned long long)h.count.load(std::memory_order_relaxed),
+			(unsigned long long)h.percentile(0.50),
+			(unsigned long long)h.percentile(0.99),
+			(unsigned long long)h.max.load(std::memory_order_relaxed));
+	}
+	return written;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "./ShareMem.h"
+#include "./PoseMath.h"
+
+//----------frame-----------
+
+// When a controller's sample was taken in by a frame, for the latency stages.
+struct FrameSample {
+	bool consumed;
+	uint64_t recvTime;
+	uint64_t consumeTime;
+};
+
+// Where the poses of a frame go: vrserver in the driver, a stand-in in the
+// benchmark.
+class PoseFrameHost {
+public:
+	virtual ~PoseFrameHost() {}
+
+	//hands the pose of every device to the host
+	virtual void submit_poses() = 0;
+};
+
+// The part of RunFrame between the shared layout and the controllers. It
+// drains the ring, keeping clicks shorter than a frame, and hands the newest
+// sample of each controller to its state. Everything in the layout is
+// decoded already, so a frame never waits on a phone.
+class PoseFrameReader {
+public:
+	PoseFrameReader();
+
+	//slots[i] is the device slot of controller i. spaceReady, if open, is
+	//woken when the ring was drained. Returns the number of drained packets.
+	uint32_t run(SharedLayout* layout, const int (&slots)[2], SharedEvent& spaceReady,
+		ControllerState* const (&controllers)[2], FrameSample (&samples)[2]);
+
+	//the poses of the frame went to the host at submitTime
+	static void submitted(SharedLayout* layout, const FrameSample (&samples)[2], uint64_t submitTime);
+
+	//a whole frame: run(), the host's submit_poses() and submitted(). Until a
+	//layout is attached it is NULL and the poses are submitted all the same.
+	uint32_t frame(SharedLayout* layout, const int (&slots)[2], SharedEvent& spaceReady,
+		ControllerState* const (&controllers)[2], PoseFrameHost& host);
+
+private:
+	uint32_t m_slotSequence[kMaxDevices];
+	RotationFilter m_rotation; //one for both controllers
+};
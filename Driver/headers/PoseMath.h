@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+//----------pose math-----------
+
+// The arithmetic behind GetPose, without OpenVR or Windows so that it builds
+// and can be measured anywhere.
+struct PoseRotation {
+	double w, x, y, z;
+};
+
+struct PoseResult {
+	double position[3];
+	PoseRotation rotation;
+	double timeOffset; //poseTimeOffset [s]
+};
+
+// roll, pitch and yaw [rad] to a quaternion
+PoseRotation EulerToQuaternion(double roll, double pitch, double yaw);
+
+// poseTimeOffset of a sample the phone sent at sampleTime [us, PC clock], so
+// prediction starts from when it was taken. 0 when unknown or over a second old.
+double SampleTimeOffset(uint64_t sampleTime, uint64_t now);
+
+//----------filters-----------
+
+// The phone sends absolute angles [deg] and the controllers turn by the
+// change since the previous sample, wrapped below 90 degrees and divided by 360.
+class RotationFilter {
+public:
+	void step(const double (&rotation)[3], double (&out)[3]);
+
+private:
+	double m_previous[3] = { 0.0 };
+};
+
+//----------controller state-----------
+
+// One controller between frames: the latest input from its phone and the
+// rotation accumulated from it.
+class ControllerState {
+public:
+	//a new sample: position [m], rotation step (RotationFilter), trackpad, click, trigger
+	void set_input(const double (&newPosition)[3], const double (&newRotationStep)[3],
+		const double (&newTrackpad)[2], bool newClicked, double newTrigger);
+
+	//no new sample this frame: stop turning
+	void hold_rotation();
+
+	//Home: the current position becomes the origin and the controller faces
+	//where the head does
+	void recenter(double headFront);
+
+	//End: only the rotation
+	void reset_rotation(double headFront);
+
+	//turns by the last step and places the controller next to the head.
+	//index 0 is the right hand, 1 the left.
+	void pose(int index, double headFront, const double (&headPosition)[3], uint64_t now, PoseResult& out);
+
+	double roll = 0.0, pitch = 0.0, yaw = 0.0;
+	double positionCorrection[3] = { 0.0 };
+	double position[3] = { 0.0 };
+	double rotationStep[3] = { 0.0 };
+	double trackpad[2] = { 0.0 };
+	bool clicked = false;
+	double trigger = 0.0;
+	uint64_t sampleTime = 0; //phone send time of the latest sample on the PC clock, 0 if unknown
+};
@@ -0,0 +1,405 @@
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "./Latency.h"
+
+//----------mapped file-----------
+
+// A whole file mapped into memory, either created at a fixed size for
+// writing or opened read-only.
+class MappedFile {
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+
+	bool create(const char* path, size_t size)
+	{
+		close();
+#ifdef _WIN32
+		m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+		m_data = m_mapping != NULL ? (uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+#else
+		m_file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (m_file < 0) {
+			return false;
+		}
+		void* p = ftruncate(m_file, (off_t)size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0) : MAP_FAILED;
+		m_data = p != MAP_FAILED ? (uint8_t*)p : NULL;
+#endif
+		m_size = size;
+		m_writable = true;
+		if (m_data == NULL) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	bool open_read(const char* path)
+	{
+		close();
+#ifdef _WIN32
+		m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+			close();
+			return false;
+		}
+		m_size = (size_t)size.QuadPart;
+		m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		m_data = m_mapping != NULL ? (uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+		m_file = ::open(path, O_RDONLY);
+		struct stat st;
+		if (m_file < 0 || fstat(m_file, &st) != 0 || st.st_size == 0) {
+			close();
+			return false;
+		}
+		m_size = (size_t)st.st_size;
+		void* p = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_file, 0);
+		m_data = p != MAP_FAILED ? (uint8_t*)p : NULL;
+#endif
+		m_writable = false;
+		if (m_data == NULL) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	//unmaps the file; a written file is cut down to 'length' bytes if given
+	void close(size_t length = 0)
+	{
+#ifdef _WIN32
+		if (m_data != NULL) {
+			UnmapViewOfFile(m_data);
+		}
+		if (m_mapping != NULL) {
+			CloseHandle(m_mapping);
+		}
+		if (m_file != INVALID_HANDLE_VALUE) {
+			if (m_writable && length > 0) {
+				LARGE_INTEGER end;
+				end.QuadPart = (LONGLONG)length;
+				SetFilePointerEx(m_file, end, NULL, FILE_BEGIN);
+				SetEndOfFile(m_file);
+			}
+			CloseHandle(m_file);
+		}
+		m_file = INVALID_HANDLE_VALUE;
+		m_mapping = NULL;
+#else
+		if (m_data != NULL) {
+			munmap(m_data, m_size);
+		}
+		if (m_file >= 0) {
+			if (m_writable && length > 0 && ftruncate(m_file, (off_t)length) != 0) {
+				printf("cannot truncate the log\n");
+			}
+			::close(m_file);
+		}
+		m_file = -1;
+#endif
+		m_data = NULL;
+		m_size = 0;
+	}
+
+	bool is_open() const { return m_data != NULL; }
+	uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = NULL;
+#else
+	int m_file = -1;
+#endif
+	uint8_t* m_data = NULL;
+	size_t m_size = 0;
+	bool m_writable = false;
+};
+
+//----------session log-----------
+
+// A recorded session is a series of segment files <base>.000.vrlog,
+// <base>.001.vrlog, ... Each starts with a SessionLogHeader, followed by
+// records: a SessionLogRecord and the message exactly as it was received,
+// padded to 8 bytes. dataEnd is updated after every record, so a segment
+// left behind by a killed process is still readable up to there.
+// Version 1 logs lack positionRange and versions before 3 lack the record
+// source and flags; both are still read.
+static const uint32_t kSessionLogMagic = 0x4C445256; //"VRDL"
+static const uint32_t kSessionLogVersion = 3;
+static const size_t kSessionLogDefaultSegment = 64 * 1024 * 1024;
+
+struct SessionLogHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t segment;   //index within the session
+	uint64_t startTime; //GetTimestampUs when the segment was created
+	uint64_t dataEnd;   //end of the last complete record
+	uint64_t records;
+	double positionRange; //of binary poses while recording, see WireConfig
+	uint8_t reserved[16];
+};
+
+struct SessionLogRecord {
+	uint32_t length;    //message bytes
+	uint16_t source;    //the phone's connection, see PosePublisher::publish
+	uint16_t flags;
+	uint64_t recvTime;  //ClientApp recv [us]
+};
+
+//SessionLogRecord::flags
+static const uint16_t kSessionLogBurstStart = 1; //first of the messages published together
+static const uint16_t kSessionLogDropLate = 2;   //late samples were dropped when it arrived
+
+static_assert(sizeof(SessionLogHeader) == 64, "SessionLogHeader format changed");
+static_assert(sizeof(SessionLogRecord) == 16, "SessionLogRecord format changed");
+
+// One record as SessionLogReader::next returns it.
+struct SessionLogEntry {
+	const char* data;
+	size_t length;
+	uint64_t recvTime;
+	uint32_t source;
+	uint16_t flags;
+};
+
+inline void SessionLogPath(char* buf, size_t size, const char* base, uint32_t segment)
+{
+	snprintf(buf, size, "%s.%03u.vrlog", base, segment);
+}
+
+// Appends received messages to the session log. append() only copies into
+// the mapping; creating and closing segment files is left to maintain(),
+// which the event loop calls while it is idle. The next segment is mapped
+// ahead of time, so rotation on the receive path is a pointer swap.
+class SessionRecorder {
+public:
+	~SessionRecorder() { close(); }
+
+	bool open(const char* base, size_t segmentSize)
+	{
+		snprintf(m_base, sizeof(m_base), "%s", base);
+		m_segmentSize = segmentSize;
+		m_nextSegment = 0;
+		m_current = 0;
+		m_retired = -1;
+		m_spareReady = false;
+		if (!map_segment(m_segments[0])) {
+			return false;
+		}
+		m_offset = sizeof(SessionLogHeader);
+		return true;
+	}
+
+	bool is_open() const { return m_segments[m_current].is_open(); }
+
+	//goes into every segment: binary poses only decode with the range they
+	//were sent with
+	void set_position_range(double positionRange)
+	{
+		m_positionRange = positionRange;
+		for (int i = 0; i < 2; i++) {
+			if (m_segments[i].is_open()) {
+				((SessionLogHeader*)m_segments[i].data())->positionRange = positionRange;
+			}
+		}
+	}
+
+	void append(const char* data, size_t length, uint64_t recvTime, uint32_t source, uint16_t flags)
+	{
+		size_t need = sizeof(SessionLogRecord) + ((length + 7) & ~(size_t)7);
+		if (m_offset + need > m_segmentSize) {
+			if (!m_spareReady || need + sizeof(SessionLogHeader) > m_segmentSize) {
+				dropped++;
+				return;
+			}
+			m_retired = m_current;
+			m_current ^= 1;
+			m_spareReady = false;
+			m_offset = sizeof(SessionLogHeader);
+		}
+
+		uint8_t* base = m_segments[m_current].data();
+		SessionLogRecord* record = (SessionLogRecord*)(base + m_offset);
+		record->length = (uint32_t)length;
+		record->source = (uint16_t)source;
+		record->flags = flags;
+		record->recvTime = recvTime;
+		memcpy(record + 1, data, length);
+		m_offset += need;
+
+		SessionLogHeader* header = (SessionLogHeader*)base;
+		header->records++;
+		header->dataEnd = m_offset;
+		records++;
+	}
+
+	//closes a full segment and maps the next one once half of this one is used
+	void maintain()
+	{
+		if (m_retired >= 0) {
+			release(m_segments[m_retired]);
+			m_retired = -1;
+		}
+		if (!m_spareReady && is_open() && m_offset > m_segmentSize / 2) {
+			m_spareReady = map_segment(m_segments[m_current ^ 1]);
+		}
+	}
+
+	void close()
+	{
+		for (int i = 0; i < 2; i++) {
+			release(m_segments[i]);
+		}
+		m_spareReady = false;
+		m_retired = -1;
+	}
+
+	uint64_t records = 0;
+	uint64_t dropped = 0; //a segment was full and the next one not mapped yet
+
+private:
+	bool map_segment(MappedFile& file)
+	{
+		char path[300];
+		SessionLogPath(path, sizeof(path), m_base, m_nextSegment);
+		if (!file.create(path, m_segmentSize)) {
+			printf("cannot create %s\n", path);
+			return false;
+		}
+		SessionLogHeader* header = (SessionLogHeader*)file.data();
+		memset(header, 0, sizeof(*header));
+		header->magic = kSessionLogMagic;
+		header->version = kSessionLogVersion;
+		header->headerSize = sizeof(SessionLogHeader);
+		header->segment = m_nextSegment++;
+		header->startTime = GetTimestampUs();
+		header->dataEnd = sizeof(SessionLogHeader);
+		header->positionRange = m_positionRange;
+		return true;
+	}
+
+	//a segment that was mapped ahead but never used is left empty
+	void release(MappedFile& file)
+	{
+		if (file.is_open()) {
+			file.close((size_t)((SessionLogHeader*)file.data())->dataEnd);
+		}
+	}
+
+	char m_base[260];
+	size_t m_segmentSize = kSessionLogDefaultSegment;
+	MappedFile m_segments[2];
+	int m_current = 0;
+	int m_retired = -1;
+	bool m_spareReady = false;
+	size_t m_offset = 0;
+	uint32_t m_nextSegment = 0;
+	double m_positionRange = 0.0;
+};
+
+// Reads a recorded session back, segment after segment, straight from the
+// mapped files. The previous segment stays mapped, so the messages of a
+// burst that spans two segments can be held together.
+class SessionLogReader {
+public:
+	bool open(const char* base)
+	{
+		snprintf(m_base, sizeof(m_base), "%s", base);
+		return open_segment(0);
+	}
+
+	//the next record; false at the end of the session. Older logs read as
+	//if every message was published alone, late filtered, from source 0.
+	bool next(SessionLogEntry& entry)
+	{
+		while (m_offset + sizeof(SessionLogRecord) > m_end) {
+			if (!open_segment(m_segment + 1)) {
+				return false;
+			}
+		}
+		const SessionLogRecord* record = (const SessionLogRecord*)(m_files[m_current].data() + m_offset);
+		size_t need = sizeof(SessionLogRecord) + (((size_t)record->length + 7) & ~(size_t)7);
+		if (m_offset + need > m_end) {
+			printf("%s: record at %llu is cut off\n", m_base, (unsigned long long)m_offset);
+			m_end = m_offset;
+			return next(entry);
+		}
+		entry.data = (const char*)(record + 1);
+		entry.length = record->length;
+		entry.recvTime = record->recvTime;
+		if (m_version >= 3) {
+			entry.source = record->source;
+			entry.flags = record->flags;
+		} else {
+			entry.source = 0;
+			entry.flags = kSessionLogBurstStart | kSessionLogDropLate;
+		}
+		m_offset += need;
+		return true;
+	}
+
+	//the position range of binary poses while recording, or 0 when the log
+	//does not say
+	double position_range() const { return m_positionRange; }
+
+private:
+	bool open_segment(uint32_t segment)
+	{
+		char path[300];
+		SessionLogPath(path, sizeof(path), m_base, segment);
+		m_offset = m_end = 0;
+		MappedFile& file = m_files[m_current ^ 1];
+		if (!file.open_read(path)) {
+			return false;
+		}
+		const SessionLogHeader* header = (const SessionLogHeader*)file.data();
+		if (file.size() < sizeof(SessionLogHeader) || header->magic != kSessionLogMagic
+			|| header->version < 1 || header->version > kSessionLogVersion || header->dataEnd > file.size()) {
+			printf("%s is not a session log\n", path);
+			file.close();
+			return false;
+		}
+		m_current ^= 1;
+		m_segment = segment;
+		m_version = header->version;
+		m_offset = header->headerSize;
+		m_end = (size_t)header->dataEnd;
+		m_positionRange = header->version >= 2 ? header->positionRange : 0.0;
+		return true;
+	}
+
+	char m_base[260];
+	MappedFile m_files[2];
+	int m_current = 0;
+	uint32_t m_segment = 0;
+	uint32_t m_version = 0;
+	size_t m_offset = 0;
+	size_t m_end = 0;
+	double m_positionRange = 0.0;
+};
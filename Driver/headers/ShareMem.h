@@ -31,17 +31,48 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #pragma once
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 #include <stdio.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <type_traits>
 #include "./picojson.h"
+#include "./Latency.h"
+#include "./FastNumber.h"
+
 
 //----------L-----------
 
 class SharedMemory {
 private:
-	DWORD SharedMemorySize = 16 * 1024; //16KB
+	uint32_t SharedMemorySize = 64 * 1024; //64KB
+#ifdef _WIN32
 	HANDLE SharedMemoryHandle = NULL;
-	LPVOID SharedMemoryBuffer = NULL;
+#else
+	int SharedMemoryHandle = -1;
+	std::string SharedMemoryName;
+#endif
+	void* SharedMemoryBuffer = NULL;
+	bool SharedMemoryCreated = false;
+	bool SharedMemoryReadOnly = false;
 
 public:
 	SharedMemory()
@@ -50,7 +81,6 @@ public:
 
 	SharedMemory(const char* Pipename)
 	{
-		printf(Pipename);
 		open(Pipename);
 	}
 
@@ -59,174 +89,1381 @@ public:
 		close();
 	}
 
-	LPVOID get_pointer() {
+	void* get_pointer() {
 		return SharedMemoryBuffer;
 	}
 
 	bool is_open() {
+#ifdef _WIN32
 		return (SharedMemoryBuffer != NULL) && (SharedMemoryHandle != NULL);
+#else
+		return (SharedMemoryBuffer != NULL) && (SharedMemoryHandle >= 0);
+#endif
+	}
+
+	//̃vZXLVKɍ쐬
+	bool created() {
+		return SharedMemoryCreated;
 	}
 
-	void set_size(DWORD _SharedMemorySize)
+	void set_size(uint32_t _SharedMemorySize)
 	{
 		SharedMemorySize = _SharedMemorySize;
 	}
 
-	DWORD get_size()
+	uint32_t get_size()
 	{
 		return SharedMemorySize;
 	}
 
-	void print(const char* fmt, ...) {
-		va_list va;
-		va_start(va, fmt);
-		vsprintf_s((char*)SharedMemoryBuffer, SharedMemorySize - 1, fmt, va);
-		va_end(va);
-	}
-
-	void open(const char* Pipename) {
+	//readOnly: ̋LǂݎpŊJ (쐬͂Ȃ)
+	void open(const char* Pipename, bool readOnly = false) {
 		//ɂłɊJĂꍇ
 		close();
+		SharedMemoryReadOnly = readOnly;
 
+#ifdef _WIN32
 		//nh̃I[v
-		SharedMemoryHandle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, SharedMemorySize, Pipename);
+		if (readOnly)
+		{
+			SharedMemoryHandle = OpenFileMappingA(FILE_MAP_READ, FALSE, Pipename);
+		}
+		else
+		{
+			SharedMemoryHandle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, SharedMemorySize, Pipename);
+		}
 		//nh̃I[vɎs
 		if (SharedMemoryHandle == NULL)
 		{
 			return;
 		}
+		SharedMemoryCreated = !readOnly && (GetLastError() != ERROR_ALREADY_EXISTS);
 
 		//̃}bsO
-		SharedMemoryBuffer = MapViewOfFile(SharedMemoryHandle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		SharedMemoryBuffer = MapViewOfFile(SharedMemoryHandle, readOnly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS, 0, 0, 0);
 		//}bsOɎs
 		if (SharedMemoryBuffer == NULL)
 		{
 			//ɊJnh
 			CloseHandle(SharedMemoryHandle);
+			SharedMemoryHandle = NULL;
+			SharedMemoryCreated = false;
+			return;
+		}
+#else
+		//POSIX̋L'/'Ŏn߂
+		SharedMemoryName = std::string("/") + Pipename;
+
+		//VK쐬݁Aɂ΂J
+		if (readOnly)
+		{
+			SharedMemoryHandle = shm_open(SharedMemoryName.c_str(), O_RDONLY, 0600);
+		}
+		else
+		{
+			SharedMemoryHandle = shm_open(SharedMemoryName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (SharedMemoryHandle >= 0)
+			{
+				SharedMemoryCreated = true;
+			}
+			else if (errno == EEXIST)
+			{
+				SharedMemoryHandle = shm_open(SharedMemoryName.c_str(), O_RDWR, 0600);
+			}
+		}
+		//nh̃I[vɎs
+		if (SharedMemoryHandle < 0)
+		{
 			return;
 		}
+
+		//TCY̊m (쐬ł܂0̏ꍇ܂)
+		struct stat st;
+		if (fstat(SharedMemoryHandle, &st) != 0)
+		{
+			close();
+			return;
+		}
+		if (st.st_size < (off_t)SharedMemorySize
+			&& (readOnly || ftruncate(SharedMemoryHandle, SharedMemorySize) != 0))
+		{
+			close();
+			return;
+		}
+
+		//̃}bsO
+		void* buffer = mmap(NULL, SharedMemorySize, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, SharedMemoryHandle, 0);
+		//}bsOɎs
+		if (buffer == MAP_FAILED)
+		{
+			close();
+			return;
+		}
+		SharedMemoryBuffer = buffer;
+#endif
 	}
 
 	void close() {
+#ifdef _WIN32
 		if (SharedMemoryBuffer != NULL) {
 			UnmapViewOfFile(SharedMemoryBuffer);
+			SharedMemoryBuffer = NULL;
 		}
 		if (SharedMemoryHandle != NULL) {
 			CloseHandle(SharedMemoryHandle);
+			SharedMemoryHandle = NULL;
+		}
+#else
+		if (SharedMemoryBuffer != NULL) {
+			munmap(SharedMemoryBuffer, SharedMemorySize);
+			SharedMemoryBuffer = NULL;
+		}
+		if (SharedMemoryHandle >= 0) {
+			::close(SharedMemoryHandle);
+			SharedMemoryHandle = -1;
+		}
+		//O͍폜ȂB쐬vZXIɍ폜ƁAJ܂܂
+		//ÔȂ̈ɎcAɍ̈ƕʂĂ܂
+#endif
+		SharedMemoryCreated = false;
+	}
+
+	//݊̂ȂÂL폜č蒼BPOSIXł͖O
+	//vZX蒷c邽߁AÂrĥcĂ邱ƂB
+	//Windowsł͍Ō̃nhƋɏ̂ŉȂ
+	bool recreate() {
+#ifdef _WIN32
+		return false;
+#else
+		if (SharedMemoryReadOnly || SharedMemoryName.empty()) {
+			return false;
+		}
+		std::string name = SharedMemoryName.substr(1);
+		shm_unlink(SharedMemoryName.c_str());
+		open(name.c_str());
+		return is_open();
+#endif
+	}
+};
+
+//----------notification-----------
+
+static const uint32_t kWaitForever = 0xFFFFFFFF;
+
+// Counter in the mapping that is bumped on every publish. Waiters sleep on
+// it (futex on Linux, named auto-reset event on Windows) and the publisher
+// only makes a syscall when somebody is actually waiting.
+struct SharedEventWord {
+	std::atomic<uint32_t> sequence;
+	std::atomic<uint32_t> waiters;
+};
+
+class SharedEvent {
+private:
+	SharedEventWord* Word = NULL;
+#ifdef _WIN32
+	HANDLE EventHandle = NULL;
+#endif
+
+public:
+	SharedEvent()
+	{
+	}
+
+	~SharedEvent()
+	{
+		close();
+	}
+
+	bool is_open() {
+#ifdef _WIN32
+		return (Word != NULL) && (EventHandle != NULL);
+#else
+		return Word != NULL;
+#endif
+	}
+
+	void open(const char* Eventname, SharedEventWord* word) {
+		close();
+		if (word == NULL) {
+			return;
+		}
+#ifdef _WIN32
+		EventHandle = CreateEventA(NULL, FALSE, FALSE, Eventname);
+		if (EventHandle == NULL) {
+			return;
+		}
+#else
+		(void)Eventname; //the futex needs nothing but the word
+#endif
+		Word = word;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (EventHandle != NULL) {
+			CloseHandle(EventHandle);
+			EventHandle = NULL;
+		}
+#endif
+		Word = NULL;
+	}
+
+	uint32_t current() {
+		return Word->sequence.load(std::memory_order_acquire);
+	}
+
+	//publisher: wakes a waiter, if any
+	void notify() {
+		Word->sequence.fetch_add(1, std::memory_order_seq_cst);
+		if (Word->waiters.load(std::memory_order_seq_cst) == 0) {
+			return;
+		}
+#ifdef _WIN32
+		SetEvent(EventHandle);
+#else
+		syscall(SYS_futex, (uint32_t*)&Word->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+	}
+
+	//waiter: blocks until the counter moves past 'seen' or the timeout expires
+	bool wait(uint32_t& seen, uint32_t timeoutMs = kWaitForever) {
+		uint32_t now = Word->sequence.load(std::memory_order_acquire);
+		if (now != seen) {
+			seen = now;
+			return true;
+		}
+
+		std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		Word->waiters.fetch_add(1, std::memory_order_seq_cst);
+		while ((now = Word->sequence.load(std::memory_order_seq_cst)) == seen) {
+			uint32_t remaining = kWaitForever;
+			if (timeoutMs != kWaitForever) {
+				long long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count();
+				if (left <= 0) {
+					break;
+				}
+				remaining = (uint32_t)left;
+			}
+#ifdef _WIN32
+			WaitForSingleObject(EventHandle, remaining == kWaitForever ? INFINITE : remaining);
+#else
+			struct timespec ts = { (time_t)(remaining / 1000), (long)(remaining % 1000) * 1000000L };
+			syscall(SYS_futex, (uint32_t*)&Word->sequence, FUTEX_WAIT, seen,
+				remaining == kWaitForever ? NULL : &ts, NULL, 0);
+#endif
+		}
+		Word->waiters.fetch_sub(1, std::memory_order_relaxed);
+
+		if (now == seen) {
+			return false;
+		}
+		seen = now;
+		return true;
+	}
+};
+
+//----------ring buffer-----------
+
+// Single-producer/single-consumer queue of fixed-size slots, placed directly
+// in the shared mapping. head is only written by the producer (ClientApp) and
+// tail only by the consumer (driver), so neither side ever waits on the other.
+// A freshly created mapping is zero filled, which is a valid empty ring.
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "ring indices must be lock-free to live in shared memory");
+
+template <typename T, uint32_t N>
+struct SpscRing {
+	static_assert((N & (N - 1)) == 0, "slot count must be a power of two");
+	static_assert(std::is_trivially_copyable<T>::value, "slots are copied between processes");
+
+	alignas(64) std::atomic<uint32_t> head;
+	alignas(64) std::atomic<uint32_t> tail;
+	alignas(64) T slots[N];
+
+	//producer: returns the next free slot, or NULL when the ring is full
+	T* reserve()
+	{
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) >= N) {
+			return NULL;
+		}
+		return &slots[h & (N - 1)];
+	}
+
+	//producer: publishes the slot returned by reserve()
+	void commit()
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool push(const T& v)
+	{
+		T* slot = reserve();
+		if (slot == NULL) {
+			return false;
+		}
+		*slot = v;
+		commit();
+		return true;
+	}
+
+	//producer: copies as many items as fit and publishes them with one store
+	uint32_t push_batch(const T* items, uint32_t count)
+	{
+		uint32_t h = head.load(std::memory_order_relaxed);
+		uint32_t space = N - (h - tail.load(std::memory_order_acquire));
+		if (count > space) {
+			count = space;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			slots[(h + i) & (N - 1)] = items[i];
+		}
+		if (count > 0) {
+			head.store(h + count, std::memory_order_release);
+		}
+		return count;
+	}
+
+	//consumer: returns the oldest published slot, or NULL when empty
+	const T* front()
+	{
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) {
+			return NULL;
 		}
+		return &slots[t & (N - 1)];
+	}
+
+	//consumer: releases the slot returned by front()
+	void pop()
+	{
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	//consumer: releases everything published so far
+	void clear()
+	{
+		tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
 	}
 };
 
-//Vf[^܂ő҂
-void WaitForNewData(char* mem)
+//----------pose packet-----------
+
+// Decoded controller sample, written by ClientApp and copied as-is by the
+// driver. This is the ABI between the two processes: both copies of this
+// header must stay identical, and kPosePacketVersion has to be bumped on
+// every layout change.
+static const uint32_t kPosePacketVersion = 3;
+
+struct PosePacket {
+	uint32_t version;
+	uint32_t id;
+	uint64_t sendTime;    //phone send time on the PC clock [us], 0 until the phone clock is synchronised
+	uint64_t recvTime;    //ClientApp recv [us]
+	uint64_t publishTime; //written to shared memory [us]
+	double translation[3];
+	double rotation[3];
+	double trackpad[2];
+	double trigger;
+	uint32_t clicked;
+	uint32_t sequence;    //assigned by ClientApp, +1 per published packet
+};
+
+static_assert(std::is_standard_layout<PosePacket>::value, "PosePacket must be POD");
+static_assert(std::is_trivially_copyable<PosePacket>::value, "PosePacket must be POD");
+static_assert(sizeof(PosePacket) == 112, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, sendTime) == 8, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, recvTime) == 16, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, publishTime) == 24, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, translation) == 32, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, rotation) == 56, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, trackpad) == 80, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, trigger) == 96, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, clicked) == 104, "PosePacket ABI changed");
+static_assert(offsetof(PosePacket, sequence) == 108, "PosePacket ABI changed");
+
+typedef SpscRing<PosePacket, 64> PoseRing;
+
+//----------latest value slots-----------
+
+// Newest sample of one device, guarded by a sequence lock. The writer never
+// waits, and the reader gets either a consistent copy or "nothing new".
+// The counter is odd while a write is in progress.
+struct alignas(64) PoseSlot {
+	std::atomic<uint32_t> sequence;
+	uint32_t reserved;
+	PosePacket packet;
+
+	//writer (ClientApp) only
+	void write(const PosePacket& p)
+	{
+		uint32_t seq = sequence.load(std::memory_order_relaxed);
+		sequence.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(&packet, &p, sizeof(packet));
+		sequence.store(seq + 2, std::memory_order_release);
+	}
+
+	//reader: true when a consistent sample newer than 'seen' was copied to out
+	bool read(PosePacket& out, uint32_t& seen) const
+	{
+		for (int retry = 0; retry < 4; retry++) {
+			uint32_t seq1 = sequence.load(std::memory_order_acquire);
+			if (seq1 == seen) {
+				return false;
+			}
+			if (seq1 & 1) {
+				continue;
+			}
+			memcpy(&out, &packet, sizeof(out));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == seq1) {
+				seen = seq1;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+static_assert(sizeof(PoseSlot) % 64 == 0, "slots must not share cache lines");
+
+//----------feedback-----------
+
+// Driver -> ClientApp messages that ClientApp forwards to the phone owning
+// the device. The driver publishes them once per frame as a batch.
+enum FeedbackType : uint32_t {
+	FeedbackType_Haptic = 1,
+	FeedbackType_Status = 2,
+};
+
+enum DeviceStatusFlags : uint32_t {
+	DeviceStatus_Tracking = 1 << 0,
+};
+
+struct FeedbackEvent {
+	uint32_t type;
+	uint32_t id;       //phone id of the device
+	float duration;    //haptic [s]
+	float frequency;   //haptic [Hz]
+	float amplitude;   //haptic [0..1]
+	uint32_t status;   //DeviceStatusFlags
+};
+
+static_assert(std::is_trivially_copyable<FeedbackEvent>::value, "FeedbackEvent must be POD");
+static_assert(sizeof(FeedbackEvent) == 24, "FeedbackEvent ABI changed");
+
+typedef SpscRing<FeedbackEvent, 64> FeedbackRing;
+
+//----------statistics-----------
+
+// Counters of the IPC path, updated with relaxed atomics by the side that
+// owns them and readable at any time by a viewer (Client --stats).
+struct StatsPage {
+	//ClientApp
+	alignas(64) std::atomic<uint64_t> packetsReceived;
+	std::atomic<uint64_t> bytesReceived;
+	std::atomic<uint64_t> parseFailures;
+	std::atomic<uint64_t> packetsDropped; //ring was full
+	std::atomic<uint64_t> packetsLate;    //superseded by a newer sample of its device
+	std::atomic<uint64_t> packetsLost;    //gaps in the phone's "seq" (udp)
+	std::atomic<uint32_t> lastSequence;   //last published
+
+	//driver
+	alignas(64) std::atomic<uint64_t> packetsConsumed;
+	std::atomic<uint64_t> framesRun;
+	std::atomic<uint32_t> lastConsumedSequence;
+};
+
+//----------layout-----------
+
+static const uint32_t kLayoutMagic = 0x46445256; //"VRDF"
+static const uint32_t kLayoutVersion = 6;
+
+static const uint32_t kMaxControllers = 4;
+static const uint32_t kMaxTrackers = 3;
+static const uint32_t kMaxDevices = 1 + kMaxControllers + kMaxTrackers;
+
+enum DeviceClass : uint32_t {
+	DeviceClass_None = 0,
+	DeviceClass_HMD = 1,
+	DeviceClass_Controller = 2,
+	DeviceClass_Tracker = 3,
+};
+
+enum LayoutCapability : uint32_t {
+	LayoutCapability_PoseRing = 1 << 0,
+	LayoutCapability_LatestSlots = 1 << 1,
+	LayoutCapability_Events = 1 << 2,
+	LayoutCapability_Stats = 1 << 3,
+	LayoutCapability_Feedback = 1 << 4,
+};
+
+// Which device owns each slot in SharedLayout::devices.
+struct DeviceEntry {
+	uint32_t deviceClass;
+	uint32_t index; //index within its class
+};
+
+struct alignas(64) SharedHeader {
+	std::atomic<uint32_t> magic; //written last by the creator
+	uint32_t version;
+	uint32_t layoutSize;
+	uint32_t capabilities;
+	std::atomic<uint32_t> producerPid; //ClientApp currently attached
+	uint32_t deviceCount;
+	std::atomic<uint64_t> heartbeat; //advanced by the producer while it runs
+	DeviceEntry devices[kMaxDevices];
+};
+
+// Everything that lives in the "pipe" mapping.
+struct SharedLayout {
+	SharedHeader header;
+	PoseRing ring;                   //every sample, in order
+	PoseSlot devices[kMaxDevices];   //newest sample per device, see header.devices
+	alignas(64) SharedEventWord spaceReady; //bumped by the driver after draining
+	alignas(64) LatencyPage latency;        //each stage recorded by the side that ends it
+	StatsPage stats;
+	FeedbackRing feedback;                  //driver -> ClientApp
+	alignas(64) SharedEventWord feedbackReady; //bumped by the driver after publishing feedback
+};
+
+static_assert(sizeof(SharedLayout) <= 64 * 1024, "layout must fit in the default mapping");
+
+inline uint32_t GetCurrentPid()
 {
-	//f[^҂tO𗧂Ă
-	mem[1] = '\0';
-	mem[0] = 'x';
+#ifdef _WIN32
+	return (uint32_t)GetCurrentProcessId();
+#else
+	return (uint32_t)getpid();
+#endif
+}
 
-	//Vf[^܂ő҂
-	printf("Waiting...\n");
-	while (mem[0] == 'x') {
-		Sleep(1);
+// Whether a process with this id is running. An id can be reused, so this
+// alone does not prove it is the process that wrote it.
+inline bool IsProcessAlive(uint32_t pid)
+{
+#ifdef _WIN32
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (process == NULL) {
+		return false;
+	}
+	bool alive = (WaitForSingleObject(process, 0) == WAIT_TIMEOUT);
+	CloseHandle(process);
+	return alive;
+#else
+	return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+// Fills in the header of a freshly created (zero filled) mapping.
+// Slot 0 is the HMD, followed by the controllers and then the trackers.
+inline void InitSharedLayout(SharedLayout* layout)
+{
+	SharedHeader& header = layout->header;
+	header.version = kLayoutVersion;
+	header.layoutSize = sizeof(SharedLayout);
+	header.capabilities = LayoutCapability_PoseRing | LayoutCapability_LatestSlots | LayoutCapability_Events
+		| LayoutCapability_Stats | LayoutCapability_Feedback;
+
+	uint32_t slot = 0;
+	header.devices[slot].deviceClass = DeviceClass_HMD;
+	header.devices[slot++].index = 0;
+	for (uint32_t i = 0; i < kMaxControllers; i++) {
+		header.devices[slot].deviceClass = DeviceClass_Controller;
+		header.devices[slot++].index = i;
+	}
+	for (uint32_t i = 0; i < kMaxTrackers; i++) {
+		header.devices[slot].deviceClass = DeviceClass_Tracker;
+		header.devices[slot++].index = i;
 	}
-	printf("New Data!\n");
+	header.deviceCount = slot;
 
+	header.magic.store(kLayoutMagic, std::memory_order_release);
 }
 
-//f[^҂̂҂
-void WaitForWaitData(char* mem)
+inline bool ValidateSharedLayout(const SharedLayout* layout, uint32_t mappingSize)
+{
+	const SharedHeader& header = layout->header;
+	return mappingSize >= sizeof(SharedLayout)
+		&& header.magic.load(std::memory_order_acquire) == kLayoutMagic
+		&& header.version == kLayoutVersion
+		&& header.layoutSize == sizeof(SharedLayout)
+		&& header.deviceCount <= kMaxDevices;
+}
+
+// Initializes the layout if this process created the mapping, then checks it.
+// A finished layout of another version, left behind on POSIX, is replaced.
+// Returns NULL until a compatible layout is present.
+inline SharedLayout* AttachSharedLayout(SharedMemory& mem)
 {
-	//Vf[^҂Ă̂҂
-	printf("Waiting...\n");
-	while (mem[0] != 'x') {
-		Sleep(1);
+	if (!mem.is_open()) {
+		return NULL;
+	}
+	SharedLayout* layout = (SharedLayout*)mem.get_pointer();
+	if (!mem.created() && layout->header.magic.load(std::memory_order_acquire) != 0
+		&& !ValidateSharedLayout(layout, mem.get_size()) && mem.recreate()) {
+		layout = (SharedLayout*)mem.get_pointer();
+	}
+	if (mem.created() && layout->header.magic.load(std::memory_order_acquire) == 0) {
+		InitSharedLayout(layout);
 	}
-	printf("Data waiting!\n");
+	return ValidateSharedLayout(layout, mem.get_size()) ? layout : NULL;
+}
 
+// Zeroes the counters and latency histograms at the start of a producer's
+// session. The mapping outlives the processes that use it (on POSIX even all
+// of them), so they would otherwise carry on from earlier runs. The sequence
+// numbers are kept, a new producer carries on where the last one stopped.
+inline void ResetSessionStats(SharedLayout* layout)
+{
+	StatsPage& stats = layout->stats;
+	stats.packetsReceived.store(0, std::memory_order_relaxed);
+	stats.bytesReceived.store(0, std::memory_order_relaxed);
+	stats.parseFailures.store(0, std::memory_order_relaxed);
+	stats.packetsDropped.store(0, std::memory_order_relaxed);
+	stats.packetsLate.store(0, std::memory_order_relaxed);
+	stats.packetsLost.store(0, std::memory_order_relaxed);
+	stats.packetsConsumed.store(0, std::memory_order_relaxed);
+	stats.framesRun.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < LatencyStage_Count; i++) {
+		layout->latency.stages[i].reset();
+	}
 }
 
-void EPrintf(char* mem, DWORD bufsize, const char* fmt, ...) {
-	va_list va;
-	va_start(va, fmt);
-	vsprintf_s(mem, bufsize, fmt, va);
-	va_end(va);
+// Returns the slot of a device, or -1 when the layout has no such device.
+inline int FindDeviceSlot(const SharedLayout* layout, uint32_t deviceClass, uint32_t index)
+{
+	for (uint32_t slot = 0; slot < layout->header.deviceCount; slot++) {
+		if (layout->header.devices[slot].deviceClass == deviceClass
+			&& layout->header.devices[slot].index == index) {
+			return (int)slot;
+		}
+	}
+	return -1;
 }
 
+// Phone ids 0..kMaxControllers-1 are controllers, the ids after them trackers.
+inline int FindPhoneSlot(const SharedLayout* layout, uint32_t id)
+{
+	if (id < kMaxControllers) {
+		return FindDeviceSlot(layout, DeviceClass_Controller, id);
+	}
+	return FindDeviceSlot(layout, DeviceClass_Tracker, id - kMaxControllers);
+}
 
-//----------json-----------
+// There is no WaitForNewData: the one consumer of poses is RunFrame, which
+// vrserver calls once per frame and which must never block. It takes the
+// newest sample of each device when the frame asks for it, so waking it on
+// every publish would gain nothing.
 
-int GetBoolValue(bool& val, picojson::value v, std::string key)
+//f[^҂̂҂
+inline bool WaitForWaitData(SharedEvent& spaceReady, uint32_t& seen, uint32_t timeoutMs = kWaitForever)
 {
-	//݃`FbN
-	if (!v.contains(key))
+	return spaceReady.wait(seen, timeoutMs);
+}
+
+//----------streaming json-----------
+
+// picojson::parse builds a DOM: a std::map per object, a std::vector per
+// array and a std::string per key, string and number. JsonStreamValue walks
+// the same grammar with picojson's input and string scanner, but keys and
+// numbers go through fixed buffers and each value is handed straight to a
+// context, so decoding a pose makes no heap allocation.
+// Contexts have the hooks of picojson's parse contexts, except that
+// parse_object_item gets the key as a JsonKey.
+static const int kJsonMaxDepth = 16;
+
+// Member name; names longer than the buffer are cut and match nothing.
+struct JsonKey {
+	char text[32];
+	size_t length;
+	bool cut;
+
+	JsonKey() : length(0), cut(false) {}
+
+	void push_back(int ch)
 	{
-		printf("%s is not found\n", key.c_str());
-		return -1;
+		if (length < sizeof(text)) {
+			text[length++] = (char)ch;
+		}
+		else {
+			cut = true;
+		}
+	}
+
+	bool is(const char* name) const
+	{
+		return !cut && strlen(name) == length && memcmp(text, name, length) == 0;
 	}
-	//^`FbN
-	if (!v.get(key).is<bool>())
+};
+
+class JsonInput : public picojson::input<const char*> {
+public:
+	JsonInput(const char* first, const char* last) : picojson::input<const char*>(first, last), depth(0) {}
+
+	//consumes the run of number characters at the current position and
+	//returns where it starts, without going through getc for each
+	const char* take_number(size_t& length)
 	{
-		printf("%s is not double\n", key.c_str());
-		return -2;
+		int ch = getc();
+		if (!IsNumberChar(ch)) {
+			ungetc();
+			length = 0;
+			return cur_;
+		}
+		const char* begin = cur_ - 1;
+		cur_ = ScanNumberChars(cur_, end_);
+		last_ch_ = cur_[-1] & 0xff;
+		length = (size_t)(cur_ - begin);
+		return begin;
+	}
+
+	int depth; //open arrays and objects
+};
+
+inline bool JsonMatch(JsonInput& in, const char* text)
+{
+	for (; *text != 0; text++) {
+		if (in.getc() != *text) {
+			in.ungetc();
+			return false;
+		}
+	}
+	return true;
+}
+
+// Converts a run of number characters with strtod, into a stack buffer.
+// The way picojson's _parse_number reads numbers.
+inline bool JsonParseNumberStrtod(const char* text, size_t length, double& out)
+{
+	char buf[64];
+	if (length == 0 || length >= sizeof(buf)) {
+		return false;
+	}
+	for (size_t i = 0; i < length; i++) {
+#if PICOJSON_USE_LOCALE
+		buf[i] = (text[i] == '.') ? *localeconv()->decimal_point : text[i];
+#else
+		buf[i] = text[i];
+#endif
 	}
-	//o
-	val = v.get(key).get<bool>();
-	return 0;
+	buf[length] = 0;
+	char* end;
+	out = strtod(buf, &end);
+	return end == buf + length;
 }
 
-int GetDoubleValue(double& val, picojson::value v, std::string key)
+// Reads a number: ParseNumberFast for the usual ones, strtod for the rest.
+inline bool JsonReadNumber(JsonInput& in, double& out)
 {
-	//݃`FbN
-	if (!v.contains(key))
+	size_t length;
+	const char* text = in.take_number(length);
+	if (length == 0 || length >= 64) {
+		return false;
+	}
+	return ParseNumberFast(text, length, out) || JsonParseNumberStrtod(text, length, out);
+}
+
+template <typename Context> bool JsonStreamValue(Context& ctx, JsonInput& in);
+
+template <typename Context> bool JsonStreamArray(Context& ctx, JsonInput& in)
+{
+	if (!ctx.parse_array_start()) {
+		return false;
+	}
+	size_t index = 0;
+	if (in.expect(']')) {
+		return ctx.parse_array_stop(index);
+	}
+	do {
+		if (!ctx.parse_array_item(in, index)) {
+			return false;
+		}
+		index++;
+	} while (in.expect(','));
+	return in.expect(']') && ctx.parse_array_stop(index);
+}
+
+template <typename Context> bool JsonStreamObject(Context& ctx, JsonInput& in)
+{
+	if (!ctx.parse_object_start()) {
+		return false;
+	}
+	if (in.expect('}')) {
+		return true;
+	}
+	do {
+		JsonKey key;
+		if (!in.expect('"') || !picojson::_parse_string(key, in) || !in.expect(':')) {
+			return false;
+		}
+		if (!ctx.parse_object_item(in, key)) {
+			return false;
+		}
+	} while (in.expect(','));
+	return in.expect('}');
+}
+
+// Parses one value and reports it to ctx.
+template <typename Context> bool JsonStreamValue(Context& ctx, JsonInput& in)
+{
+	in.skip_ws();
+	int ch = in.getc();
+	switch (ch) {
+	case 'n':
+		return JsonMatch(in, "ull") && ctx.set_null();
+	case 'f':
+		return JsonMatch(in, "alse") && ctx.set_bool(false);
+	case 't':
+		return JsonMatch(in, "rue") && ctx.set_bool(true);
+	case '"':
+		return ctx.parse_string(in);
+	case '[':
+	case '{': {
+		if (in.depth >= kJsonMaxDepth) {
+			return false;
+		}
+		in.depth++;
+		bool parsed = (ch == '[') ? JsonStreamArray(ctx, in) : JsonStreamObject(ctx, in);
+		in.depth--;
+		return parsed;
+	}
+	default:
+		if (('0' <= ch && ch <= '9') || ch == '-') {
+			double number;
+			in.ungetc();
+			return JsonReadNumber(in, number) && ctx.set_number(number);
+		}
+		break;
+	}
+	in.ungetc();
+	return false;
+}
+
+// Consumes a value and keeps none of it.
+class JsonSkipContext {
+public:
+	bool set_null() { return true; }
+	bool set_bool(bool) { return true; }
+	bool set_number(double) { return true; }
+	bool parse_string(JsonInput& in)
+	{
+		picojson::null_parse_context::dummy_str ignored;
+		return picojson::_parse_string(ignored, in);
+	}
+	bool parse_array_start() { return true; }
+	bool parse_array_item(JsonInput& in, size_t)
 	{
-		printf("%s is not found\n", key.c_str());
-		return -1;
+		JsonSkipContext skip;
+		return JsonStreamValue(skip, in);
 	}
-	//^`FbN
-	if (!v.get(key).is <double>())
+	bool parse_array_stop(size_t) { return true; }
+	bool parse_object_start() { return true; }
+	bool parse_object_item(JsonInput& in, const JsonKey&)
 	{
-		printf("%s is not double\n", key.c_str());
-		return -2;
+		JsonSkipContext skip;
+		return JsonStreamValue(skip, in);
 	}
-	//o
-	val = v.get(key).get<double>();
-	return 0;
+};
+
+// A number member. A value of any other type is consumed and leaves the
+// target untouched, like a missing member.
+class JsonNumberContext : public JsonSkipContext {
+public:
+	explicit JsonNumberContext(double* out) : found(false), m_out(out) {}
+	bool set_number(double number)
+	{
+		*m_out = number;
+		found = true;
+		return true;
+	}
+	bool found;
+
+private:
+	double* m_out;
+};
+
+class JsonBoolContext : public JsonSkipContext {
+public:
+	explicit JsonBoolContext(bool* out) : found(false), m_out(out) {}
+	bool set_bool(bool b)
+	{
+		*m_out = b;
+		found = true;
+		return true;
+	}
+	bool found;
+
+private:
+	bool* m_out;
+};
+
+// A short string such as a name; longer ones are cut and match nothing.
+class JsonStringContext : public JsonSkipContext {
+public:
+	JsonStringContext() : found(false) {}
+	bool parse_string(JsonInput& in)
+	{
+		found = true;
+		return picojson::_parse_string(text, in);
+	}
+	bool found;
+	JsonKey text;
+};
+
+// Hands the member 'name' of an object to another context and skips the
+// rest, e.g. JsonMemberContext<JsonStringContext> for {"name":"text"}.
+template <typename Inner> class JsonMemberContext : public JsonSkipContext {
+public:
+	JsonMemberContext(const char* name, Inner& inner) : m_name(name), m_inner(inner) {}
+	bool parse_object_item(JsonInput& in, const JsonKey& key)
+	{
+		if (!key.is(m_name)) {
+			return JsonSkipContext::parse_object_item(in, key);
+		}
+		return JsonStreamValue(m_inner, in);
+	}
+
+private:
+	const char* m_name;
+	Inner& m_inner;
+};
+
+// An array of exactly 'count' numbers, stored only once all of them are.
+class JsonNumberArrayContext : public JsonSkipContext {
+public:
+	static const size_t kMaxCount = 4;
+
+	JsonNumberArrayContext(double* out, size_t count) : stored(false), m_out(out), m_count(count), m_valid(false) {}
+	bool parse_array_start()
+	{
+		m_valid = (m_count <= kMaxCount);
+		return true;
+	}
+	bool parse_array_item(JsonInput& in, size_t index)
+	{
+		if (index >= m_count) {
+			m_valid = false;
+			return JsonSkipContext::parse_array_item(in, index);
+		}
+		JsonNumberContext item(&m_values[index]);
+		if (!JsonStreamValue(item, in)) {
+			return false;
+		}
+		m_valid = m_valid && item.found;
+		return true;
+	}
+	bool parse_array_stop(size_t count)
+	{
+		if (m_valid && count == m_count) {
+			memcpy(m_out, m_values, sizeof(double) * m_count);
+			stored = true;
+		}
+		return true;
+	}
+	bool stored;
+
+private:
+	double* m_out;
+	size_t m_count;
+	bool m_valid;
+	double m_values[kMaxCount];
+};
+
+//----------schema-----------
+
+// Binds the members of a JSON object to the members of a struct. A schema
+// is declared once; type and arity come from the member declarations:
+//   static constexpr JsonField<Pose> kPoseFields[] = {
+//       JSON_FIELD(Pose, id, true),        //double, required
+//       JSON_FIELD(Pose, rotation, false), //double[3], optional
+//   };
+//   static constexpr JsonSchema<Pose, 2> kPoseSchema = MakeJsonSchema(kPoseFields);
+// MakeJsonSchema finds a perfect hash of the names at compile time, so a key
+// costs one hash and one compare, in the same pass that parses the message.
+// Optional members of the wrong type are left alone, as if absent.
+enum JsonFieldType {
+	JsonField_Number, //double, or an array of doubles
+	JsonField_Bool,
+};
+
+template <typename M> struct JsonMemberTraits;
+
+template <> struct JsonMemberTraits<double> {
+	static constexpr JsonFieldType type = JsonField_Number;
+	static constexpr size_t count = 1;
+};
+
+template <size_t N> struct JsonMemberTraits<double[N]> {
+	static_assert(N <= JsonNumberArrayContext::kMaxCount, "array too long to bind");
+	static constexpr JsonFieldType type = JsonField_Number;
+	static constexpr size_t count = N;
+};
+
+template <> struct JsonMemberTraits<bool> {
+	static constexpr JsonFieldType type = JsonField_Bool;
+	static constexpr size_t count = 1;
+};
+
+template <typename T, typename M, M T::*Member> struct JsonMemberAccess {
+	static void* get(T& target) { return &(target.*Member); }
+};
+
+template <typename T> struct JsonField {
+	const char* name;
+	size_t nameLength;
+	JsonFieldType type;
+	size_t count;           //1, or the length of the array
+	bool required;
+	void* (*member)(T&);
+};
+
+constexpr size_t JsonNameLength(const char* name)
+{
+	size_t length = 0;
+	while (name[length] != 0) {
+		length++;
+	}
+	return length;
 }
-int GetDoubleArry(double arry[], unsigned int num, picojson::value v, std::string key)
+
+#define JSON_FIELD(T, member, required) \
+	JsonField<T>{ #member, JsonNameLength(#member), JsonMemberTraits<decltype(T::member)>::type, \
+		JsonMemberTraits<decltype(T::member)>::count, required, \
+		&JsonMemberAccess<T, decltype(T::member), &T::member>::get }
+
+//FNV-1a, seeded
+constexpr uint32_t JsonNameHash(uint32_t seed, const char* name, size_t length)
 {
-	//݃`FbN
-	if (!v.contains(key))
+	uint32_t hash = 2166136261u ^ seed;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static const size_t kJsonSchemaSlots = 32;
+
+template <typename T, size_t N> struct JsonSchema {
+	JsonField<T> fields[N];
+	uint32_t seed;                  //0 when no perfect hash was found
+	int8_t slots[kJsonSchemaSlots]; //hash -> field index, -1 if none
+
+	//index of the field with this name, or -1
+	int find(const char* name, size_t length) const
 	{
-		printf("%s is not found\n", key.c_str());
-		return -1;
+		int index = slots[JsonNameHash(seed, name, length) & (kJsonSchemaSlots - 1)];
+		if (index < 0 || fields[index].nameLength != length || memcmp(fields[index].name, name, length) != 0) {
+			return -1;
+		}
+		return index;
+	}
+};
+
+template <typename T, size_t N>
+constexpr JsonSchema<T, N> MakeJsonSchema(const JsonField<T> (&fields)[N])
+{
+	static_assert(N <= kJsonSchemaSlots / 2, "too many fields for the hash table");
+	JsonSchema<T, N> schema{};
+	for (size_t i = 0; i < N; i++) {
+		schema.fields[i] = fields[i];
+	}
+	for (uint32_t seed = 1; seed < 10000; seed++) {
+		for (size_t slot = 0; slot < kJsonSchemaSlots; slot++) {
+			schema.slots[slot] = -1;
+		}
+		bool collision = false;
+		for (size_t i = 0; i < N && !collision; i++) {
+			size_t slot = JsonNameHash(seed, fields[i].name, fields[i].nameLength) & (kJsonSchemaSlots - 1);
+			collision = (schema.slots[slot] >= 0);
+			schema.slots[slot] = (int8_t)i;
+		}
+		if (!collision) {
+			schema.seed = seed;
+			return schema;
+		}
 	}
-	//^`FbN
-	if (!v.get(key).is<picojson::array>())
+	return schema;
+}
+
+enum JsonBindError {
+	JsonBind_Ok,
+	JsonBind_Syntax,    //not JSON, or nested deeper than kJsonMaxDepth
+	JsonBind_NotObject,
+	JsonBind_Missing,   //a required member is absent
+	JsonBind_WrongType, //a required member has another type or length
+};
+
+inline const char* JsonBindErrorName(JsonBindError error)
+{
+	switch (error) {
+	case JsonBind_Ok: return "ok";
+	case JsonBind_Syntax: return "syntax error";
+	case JsonBind_NotObject: return "not an object";
+	case JsonBind_Missing: return "missing";
+	case JsonBind_WrongType: return "of the wrong type";
+	}
+	return "?";
+}
+
+struct JsonBindResult {
+	JsonBindError error;
+	int field;          //index of the member at fault, or -1
+	int line;           //where parsing stopped
+	uint32_t bound;     //bit i: fields[i] was stored
+	uint32_t mistyped;  //bit i: fields[i] was present but not stored
+};
+
+template <typename T, size_t N>
+class JsonBindContext : public JsonSkipContext {
+public:
+	JsonBindContext(const JsonSchema<T, N>& schema, T& target)
+		: bound(0), mistyped(0), notObject(false), m_schema(schema), m_target(target) {}
+
+	bool set_null() { return not_object(); }
+	bool set_bool(bool) { return not_object(); }
+	bool set_number(double) { return not_object(); }
+	bool parse_string(JsonInput&) { return not_object(); }
+	bool parse_array_start() { return not_object(); }
+	bool parse_object_item(JsonInput& in, const JsonKey& key)
 	{
-		printf("%s is not array\n", key.c_str());
-		return -2;
+		int index = key.cut ? -1 : m_schema.find(key.text, key.length);
+		if (index < 0) {
+			JsonSkipContext skip;
+			return JsonStreamValue(skip, in);
+		}
+
+		const JsonField<T>& field = m_schema.fields[index];
+		void* member = field.member(m_target);
+		bool parsed, stored;
+		if (field.type == JsonField_Bool) {
+			JsonBoolContext value((bool*)member);
+			parsed = JsonStreamValue(value, in);
+			stored = value.found;
+		}
+		else if (field.count == 1) {
+			JsonNumberContext value((double*)member);
+			parsed = JsonStreamValue(value, in);
+			stored = value.found;
+		}
+		else {
+			JsonNumberArrayContext value((double*)member, field.count);
+			parsed = JsonStreamValue(value, in);
+			stored = value.stored;
+		}
+		uint32_t bit = 1u << index;
+		if (stored) {
+			bound |= bit;
+			mistyped &= ~bit;
+		}
+		else {
+			mistyped |= bit;
+		}
+		return parsed;
 	}
 
-	//zTCY`FbN
-	picojson::array vx = v.get(key).get<picojson::array>();
-	if (vx.size() != num)
+	uint32_t bound;
+	uint32_t mistyped;
+	bool notObject;
+
+private:
+	bool not_object()
 	{
-		printf("%s unmatch array size. Result: %d vs Expected: %d\n", key.c_str(), vx.size(), num);
-		return -3;
+		notObject = true;
+		return false;
 	}
 
-	//z^`FbN
-	for (unsigned int i = 0; i < num; i++) {
-		if (!vx[i].is<double>())
-		{
-			printf("%s[%d] unmatch type.\n", key.c_str(), i);
-			return -4;
+	const JsonSchema<T, N>& m_schema;
+	T& m_target;
+};
+
+// Parses the value at the current position of in and stores the members the
+// schema knows into target. For objects nested in a message: a context binds
+// its member with this and goes on with the rest.
+template <typename T, size_t N>
+inline JsonBindResult JsonBindValue(const JsonSchema<T, N>& schema, JsonInput& in, T& target)
+{
+	JsonBindContext<T, N> ctx(schema, target);
+	bool parsed = JsonStreamValue(ctx, in);
+
+	JsonBindResult result = { JsonBind_Ok, -1, in.line(), ctx.bound, ctx.mistyped };
+	if (ctx.notObject) {
+		result.error = JsonBind_NotObject;
+	}
+	else if (!parsed) {
+		result.error = JsonBind_Syntax;
+	}
+	else {
+		for (size_t i = 0; i < N; i++) {
+			uint32_t bit = 1u << i;
+			if (schema.fields[i].required && (ctx.bound & bit) == 0) {
+				result.error = (ctx.mistyped & bit) ? JsonBind_WrongType : JsonBind_Missing;
+				result.field = (int)i;
+				break;
+			}
 		}
 	}
+	return result;
+}
+
+// Parses text and stores the members the schema knows into target.
+template <typename T, size_t N>
+inline JsonBindResult JsonBind(const JsonSchema<T, N>& schema, const char* text, size_t length, T& target)
+{
+	JsonInput in(text, text + length);
+	return JsonBindValue(schema, in, target);
+}
+
+// Bound numbers are doubles, and "1e999" is one too (infinity). Before one
+// is cast to an integer it has to be finite and in [0, limit); false for NaN.
+inline bool JsonInRange(double value, double limit)
+{
+	return value >= 0.0 && value < limit;
+}
+
+static const double kJsonUint32Limit = 4294967296.0;           //2^32
+static const double kJsonInt64Limit = 9223372036854775808.0;   //2^63
+static const double kJsonUint64Limit = 18446744073709551616.0; //2^64
+
+//----------pose message-----------
+
+// A JSON pose as the phone sends it.
+struct PoseMessage {
+	double id;
+	double seq;        //the phone's message number from 1, 0 if not numbered
+	double timestamp;  //seconds on the phone, 0 if unknown
+	bool clicked;
+	double trigger;
+	double trackpad[2];
+	double translation[3];
+	double rotation[3];
+};
+
+static constexpr JsonField<PoseMessage> kPoseMessageFields[] = {
+	JSON_FIELD(PoseMessage, id, true),
+	JSON_FIELD(PoseMessage, seq, false),
+	JSON_FIELD(PoseMessage, timestamp, false),
+	JSON_FIELD(PoseMessage, clicked, false),
+	JSON_FIELD(PoseMessage, trigger, false),
+	JSON_FIELD(PoseMessage, trackpad, false),
+	JSON_FIELD(PoseMessage, translation, false),
+	JSON_FIELD(PoseMessage, rotation, false),
+};
+
+static constexpr JsonSchema<PoseMessage, sizeof(kPoseMessageFields) / sizeof(kPoseMessageFields[0])>
+	kPoseMessageSchema = MakeJsonSchema(kPoseMessageFields);
+static_assert(kPoseMessageSchema.seed != 0, "no perfect hash for the pose message fields");
+
+// Parses one JSON message from the phone into a PosePacket.
+// Missing optional fields are left as zero, like the driver used to do.
+// The phone's own message number ("seq", from 1) goes to phoneSequence.
+// Nothing is printed here, a bad phone can send hundreds a second: why the
+// message did not bind goes to 'error', if given, for the caller to log.
+inline bool DecodePosePacket(const char* text, size_t length, PosePacket& packet, uint32_t* phoneSequence = NULL,
+	JsonBindResult* error = NULL)
+{
+	PoseMessage message;
+	memset(&message, 0, sizeof(message));
+	JsonBindResult result = JsonBind(kPoseMessageSchema, text, length, message);
+	if (error != NULL) {
+		*error = result;
+	}
+	if (result.error != JsonBind_Ok) {
+		return false;
+	}
+	// out of range, the casts below are undefined: {"id":1e999} would come
+	// out as controller 0. A timestamp of 0 or less means none was sent.
+	double sendTime = message.timestamp * 1000000.0;
+	if (!JsonInRange(message.id, (double)kMaxDevices) || !JsonInRange(message.seq, kJsonUint32Limit)
+		|| !std::isfinite(sendTime) || sendTime >= kJsonUint64Limit) {
+		return false;
+	}
 
-	//Rs[
-	for (unsigned int i = 0; i < num; i++) {
-		arry[i] = vx[i].get<double>();
+	memset(&packet, 0, sizeof(packet));
+	packet.version = kPosePacketVersion;
+	packet.id = (uint32_t)message.id;
+	if (sendTime > 0.0) {
+		packet.sendTime = (uint64_t)sendTime;
+	}
+	memcpy(packet.translation, message.translation, sizeof(packet.translation));
+	memcpy(packet.rotation, message.rotation, sizeof(packet.rotation));
+	memcpy(packet.trackpad, message.trackpad, sizeof(packet.trackpad));
+	packet.trigger = message.trigger;
+	packet.clicked = message.clicked ? 1 : 0;
+	if (phoneSequence != NULL) {
+		*phoneSequence = (uint32_t)message.seq;
 	}
-	return 0;
+	return true;
 }
+
+// Everything the driver reads from a packet has to be usable as it is: the
+// driver takes samples straight into poses and never parses or checks them
+// on the frame. A NaN or infinity, from "1e999" or a broken phone, is
+// stopped here instead.
+inline bool ValidatePosePacket(const PosePacket& packet)
+{
+	double values[9];
+	memcpy(values, packet.translation, sizeof(packet.translation));
+	memcpy(values + 3, packet.rotation, sizeof(packet.rotation));
+	memcpy(values + 6, packet.trackpad, sizeof(packet.trackpad));
+	values[8] = packet.trigger;
+	for (int i = 0; i < 9; i++) {
+		if (!std::isfinite(values[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//----------arrival order-----------
+
+// Keeps only the freshest sample of each device when the transport may lose
+// or reorder messages (UDP). Messages are ordered by the phone's "seq", or by
+// their send timestamp when the phone does not number them.
+// A device that another phone ('source') starts sending is taken as new, and
+// so is a jump back by more than the window: a restarted phone.
+static const int32_t kSequenceRestartWindow = 1024;
+static const uint64_t kSendTimeRestartWindow = 1000000; //us
+
+struct ArrivalFilter {
+	uint32_t lastSequence[kMaxDevices];
+	uint64_t lastSendTime[kMaxDevices];
+	uint32_t lastSource[kMaxDevices];
+	bool seen[kMaxDevices];
+
+	ArrivalFilter() { reset(); }
+	void reset() { memset(this, 0, sizeof(*this)); }
+
+	//returns false for a late or duplicated sample, which must be dropped.
+	//'lost' receives the number of sequence numbers skipped over.
+	bool accept(uint32_t slot, uint32_t source, uint32_t sequence, uint64_t sendTime, uint32_t& lost)
+	{
+		lost = 0;
+		if (seen[slot] && source == lastSource[slot]) {
+			//a late datagram was sent before the newest one; numbers starting
+			//over with a newer timestamp are a phone that restarted
+			bool older = (sendTime == 0 || lastSendTime[slot] == 0 || sendTime <= lastSendTime[slot]);
+			if (sequence != 0 && lastSequence[slot] != 0) {
+				int32_t ahead = (int32_t)(sequence - lastSequence[slot]);
+				if (ahead <= 0 && ahead > -kSequenceRestartWindow && older) {
+					return false;
+				}
+				if (ahead > 1 && ahead < kSequenceRestartWindow) {
+					lost = (uint32_t)(ahead - 1);
+				}
+			}
+			else if (sendTime != 0 && sendTime <= lastSendTime[slot]
+				&& lastSendTime[slot] - sendTime < kSendTimeRestartWindow) {
+				return false;
+			}
+		}
+		seen[slot] = true;
+		lastSource[slot] = source;
+		lastSequence[slot] = sequence;
+		lastSendTime[slot] = sendTime;
+		return true;
+	}
+};
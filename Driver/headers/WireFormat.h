@@ -0,0 +1,167 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "./ShareMem.h"
+
+//----------binary pose-----------
+
+// Compact alternative to the JSON pose, 34 bytes instead of ~150.
+// All fields little endian:
+//   0  u8      magic (kWireMagic, never '{')
+//   1  u8      version (kWireVersion)
+//   2  u8      id
+//   3  u8      buttons, bit 0 = clicked
+//   4  u32     seq, 0 if not numbered
+//   8  u64     timestamp [us, phone clock], 0 if unknown
+//   16 i16[3]  translation, full scale = positionRange [m]
+//   22 i16[3]  rotation, full scale = 180 [deg]
+//   28 i16[2]  trackpad, full scale = 1
+//   32 u16     trigger, full scale = 1
+// The phone learns positionRange from the hello reply.
+static const uint8_t kWireMagic = 0xB5;
+static const uint8_t kWireVersion = 1;
+static const size_t kWirePacketSize = 34;
+static const double kWireRotationRange = 180.0;
+static const double kWireDefaultPositionRange = 2.0;
+
+struct WireConfig {
+	double positionRange = kWireDefaultPositionRange;
+};
+
+inline bool IsWirePacket(const char* data, size_t length)
+{
+	return length > 0 && (uint8_t)data[0] == kWireMagic;
+}
+
+inline uint32_t WireGetU32(const uint8_t* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void WirePutU32(uint8_t* p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+//value in [-range, range] from a signed 16 bit sample
+inline double WireGetScaled(const uint8_t* p, double range)
+{
+	int16_t q = (int16_t)((uint16_t)p[0] | ((uint16_t)p[1] << 8));
+	return q * range / 32767.0;
+}
+
+inline void WirePutScaled(uint8_t* p, double value, double range)
+{
+	double q = floor(value / range * 32767.0 + 0.5);
+	int16_t v = (int16_t)(q > 32767.0 ? 32767.0 : (q < -32767.0 ? -32767.0 : q));
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)((uint16_t)v >> 8);
+}
+
+// Decodes a binary pose into a PosePacket, like DecodePosePacket does for JSON.
+inline bool DecodeWirePacket(const char* data, size_t length, const WireConfig& config,
+	PosePacket& packet, uint32_t* phoneSequence = NULL)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	if (length != kWirePacketSize || p[0] != kWireMagic || p[1] != kWireVersion) {
+		return false;
+	}
+
+	memset(&packet, 0, sizeof(packet));
+	packet.version = kPosePacketVersion;
+	packet.id = p[2];
+	packet.clicked = p[3] & 1;
+	if (phoneSequence != NULL) {
+		*phoneSequence = WireGetU32(p + 4);
+	}
+	packet.sendTime = (uint64_t)WireGetU32(p + 8) | ((uint64_t)WireGetU32(p + 12) << 32);
+	for (int i = 0; i < 3; i++) {
+		packet.translation[i] = WireGetScaled(p + 16 + i * 2, config.positionRange);
+		packet.rotation[i] = WireGetScaled(p + 22 + i * 2, kWireRotationRange);
+	}
+	for (int i = 0; i < 2; i++) {
+		packet.trackpad[i] = WireGetScaled(p + 28 + i * 2, 1.0);
+	}
+	packet.trigger = ((uint16_t)p[32] | ((uint16_t)p[33] << 8)) / 65535.0;
+	return true;
+}
+
+// Encodes a pose the way a phone would send it; out must hold kWirePacketSize bytes.
+inline void EncodeWirePacket(const PosePacket& packet, uint32_t phoneSequence, const WireConfig& config, uint8_t* out)
+{
+	out[0] = kWireMagic;
+	out[1] = kWireVersion;
+	out[2] = (uint8_t)packet.id;
+	out[3] = packet.clicked ? 1 : 0;
+	WirePutU32(out + 4, phoneSequence);
+	WirePutU32(out + 8, (uint32_t)packet.sendTime);
+	WirePutU32(out + 12, (uint32_t)(packet.sendTime >> 32));
+	for (int i = 0; i < 3; i++) {
+		WirePutScaled(out + 16 + i * 2, packet.translation[i], config.positionRange);
+		WirePutScaled(out + 22 + i * 2, packet.rotation[i], kWireRotationRange);
+	}
+	for (int i = 0; i < 2; i++) {
+		WirePutScaled(out + 28 + i * 2, packet.trackpad[i], 1.0);
+	}
+	double trigger = packet.trigger < 0.0 ? 0.0 : (packet.trigger > 1.0 ? 1.0 : packet.trigger);
+	uint16_t q = (uint16_t)floor(trigger * 65535.0 + 0.5);
+	out[32] = (uint8_t)q;
+	out[33] = (uint8_t)(q >> 8);
+}
+
+//----------negotiation-----------
+
+// A phone that can send binary poses opens with
+//   {"hello":{"formats":["binary","json"]}}
+// and ClientApp answers with the format to use and its parameters:
+//   {"hello":{"format":"binary","version":1,"positionRange":2,"rotationRange":180}}
+// Phones that never say hello keep sending JSON.
+inline bool IsHello(const char* data, size_t length)
+{
+	static const char kKey[] = "\"hello\"";
+	size_t keyLength = sizeof(kKey) - 1;
+	for (size_t i = 0; i + keyLength <= length && i < 16; i++) {
+		if (memcmp(data + i, kKey, keyLength) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// "formats":[...] of a hello: notes whether "binary" is among them.
+class HelloFormatsContext : public JsonSkipContext {
+public:
+	HelloFormatsContext() : binary(false) {}
+	bool parse_array_item(JsonInput& in, size_t)
+	{
+		JsonStringContext format;
+		if (!JsonStreamValue(format, in)) {
+			return false;
+		}
+		binary = binary || (format.found && format.text.is("binary"));
+		return true;
+	}
+	bool binary;
+};
+
+// Parses a hello and writes the reply line into buf. Returns its length.
+// Streams the text like a pose, so nothing in a hello can throw.
+inline int AnswerHello(const char* data, size_t length, const WireConfig& config, char* buf, size_t size)
+{
+	HelloFormatsContext formats;
+	JsonMemberContext<HelloFormatsContext> hello("formats", formats);
+	JsonMemberContext<JsonMemberContext<HelloFormatsContext> > root("hello", hello);
+	JsonInput in(data, data + length);
+	bool binary = JsonStreamValue(root, in) && formats.binary;
+	if (!binary) {
+		return snprintf(buf, size, "{\"hello\":{\"format\":\"json\"}}\n");
+	}
+	return snprintf(buf, size, "{\"hello\":{\"format\":\"binary\",\"version\":%u,\"positionRange\":%g,\"rotationRange\":%g}}\n",
+		kWireVersion, config.positionRange, kWireRotationRange);
+}
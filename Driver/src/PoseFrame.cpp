@@ -0,0 +1,84 @@
+#include "../headers/PoseFrame.h"
+
+PoseFrameReader::PoseFrameReader()
+{
+	memset(m_slotSequence, 0, sizeof(m_slotSequence));
+}
+
+uint32_t PoseFrameReader::run(SharedLayout* layout, const int (&slots)[2], SharedEvent& spaceReady,
+	ControllerState* const (&controllers)[2], FrameSample (&samples)[2])
+{
+	// the ring holds every sample since the last frame. poses only need the
+	// newest one, but a click shorter than a frame must not be lost.
+	bool clickLatched[2] = { false, false };
+	uint32_t drained = 0;
+	uint32_t lastSequence = 0;
+	const PosePacket* queued;
+	while ((queued = layout->ring.front()) != NULL) {
+		if (queued->version == kPosePacketVersion && queued->id < 2 && queued->clicked) {
+			clickLatched[queued->id] = true;
+		}
+		lastSequence = queued->sequence;
+		layout->ring.pop();
+		drained++;
+	}
+	layout->stats.framesRun.fetch_add(1, std::memory_order_relaxed);
+	if (drained > 0) {
+		layout->stats.packetsConsumed.fetch_add(drained, std::memory_order_relaxed);
+		layout->stats.lastConsumedSequence.store(lastSequence, std::memory_order_relaxed);
+		if (spaceReady.is_open()) {
+			spaceReady.notify();
+		}
+	}
+
+	for (uint32_t index = 0; index < 2; index++) {
+		FrameSample& sample = samples[index];
+		sample.consumed = false;
+		sample.recvTime = sample.consumeTime = 0;
+
+		PosePacket packet;
+		int slot = slots[index];
+		if (!layout->devices[slot].read(packet, m_slotSequence[slot])
+			|| packet.version != kPosePacketVersion) {
+			controllers[index]->hold_rotation();
+			continue;
+		}
+		sample.consumed = true;
+		sample.recvTime = packet.recvTime;
+		sample.consumeTime = GetTimestampUs();
+		layout->latency.stages[LatencyStage_PublishToConsume].record_span(packet.publishTime, sample.consumeTime);
+
+		double rotationStep[3];
+		m_rotation.step(packet.rotation, rotationStep);
+		controllers[index]->set_input(packet.translation, rotationStep,
+			packet.trackpad, packet.clicked != 0 || clickLatched[index],
+			packet.trigger);
+		controllers[index]->sampleTime = packet.sendTime;
+	}
+	return drained;
+}
+
+void PoseFrameReader::submitted(SharedLayout* layout, const FrameSample (&samples)[2], uint64_t submitTime)
+{
+	for (uint32_t index = 0; index < 2; index++) {
+		if (samples[index].consumed) {
+			layout->latency.stages[LatencyStage_ConsumeToSubmit].record_span(samples[index].consumeTime, submitTime);
+			layout->latency.stages[LatencyStage_RecvToSubmit].record_span(samples[index].recvTime, submitTime);
+		}
+	}
+}
+
+uint32_t PoseFrameReader::frame(SharedLayout* layout, const int (&slots)[2], SharedEvent& spaceReady,
+	ControllerState* const (&controllers)[2], PoseFrameHost& host)
+{
+	FrameSample samples[2];
+	uint32_t drained = 0;
+	if (layout != NULL) {
+		drained = run(layout, slots, spaceReady, controllers, samples);
+	}
+	host.submit_poses();
+	if (layout != NULL) {
+		submitted(layout, samples, GetTimestampUs());
+	}
+	return drained;
+}
@@ -0,0 +1,82 @@
+#include "../headers/PoseMath.h"
+
+#include <math.h>
+#include <string.h>
+
+PoseRotation EulerToQuaternion(double roll, double pitch, double yaw)
+{
+	double cR = cos(roll * 0.5);
+	double sR = sin(roll * 0.5);
+	double cP = cos(pitch * 0.5);
+	double sP = sin(pitch * 0.5);
+	double cY = cos(yaw * 0.5);
+	double sY = sin(yaw * 0.5);
+
+	PoseRotation q;
+	q.w = cR * cP * cY + sR * sP * sY;
+	q.x = sR * cP * cY - cR * sP * sY;
+	q.y = cR * sP * cY + sR * cP * sY;
+	q.z = -sR * sP * cY + cR * cP * sY;
+	return q;
+}
+
+double SampleTimeOffset(uint64_t sampleTime, uint64_t now)
+{
+	if (sampleTime != 0 && now > sampleTime && now - sampleTime < 1000000) {
+		return -(double)(now - sampleTime) / 1000000.0;
+	}
+	return 0.0;
+}
+
+void RotationFilter::step(const double (&rotation)[3], double (&out)[3])
+{
+	for (int i = 0; i < 3; i++) {
+		out[i] = fmod(rotation[i] - m_previous[i], 90.0) / 360.0;
+	}
+	memcpy(m_previous, rotation, sizeof(m_previous));
+}
+
+void ControllerState::set_input(const double (&newPosition)[3], const double (&newRotationStep)[3],
+	const double (&newTrackpad)[2], bool newClicked, double newTrigger)
+{
+	memcpy(position, newPosition, sizeof(position));
+	memcpy(rotationStep, newRotationStep, sizeof(rotationStep));
+	memcpy(trackpad, newTrackpad, sizeof(trackpad));
+	clicked = newClicked;
+	trigger = newTrigger;
+}
+
+void ControllerState::hold_rotation()
+{
+	rotationStep[0] = rotationStep[1] = rotationStep[2] = 0.0;
+}
+
+void ControllerState::recenter(double headFront)
+{
+	memcpy(positionCorrection, position, sizeof(positionCorrection));
+	reset_rotation(headFront);
+}
+
+void ControllerState::reset_rotation(double headFront)
+{
+	roll = yaw = 0;
+	pitch = headFront;
+}
+
+void ControllerState::pose(int index, double headFront, const double (&headPosition)[3], uint64_t now, PoseResult& out)
+{
+	out.timeOffset = SampleTimeOffset(sampleTime, now);
+
+	//held 0.2 m to the side of the head, 0.3 m below and in front of it
+	double x = position[0] - positionCorrection[0] + 0.2 * (1.0 - 2.0 * (double)index);
+	double y = position[1] - positionCorrection[1] - 0.3;
+	double z = position[2] - positionCorrection[2] - 0.3;
+	out.position[0] = x * cos(headFront) + z * sin(headFront) + headPosition[0];
+	out.position[1] = y + headPosition[1];
+	out.position[2] = z * cos(headFront) - x * sin(headFront) + headPosition[2];
+
+	roll += rotationStep[0];
+	pitch += rotationStep[1];
+	yaw += rotationStep[2];
+	out.rotation = EulerToQuaternion(roll, pitch, yaw);
+}
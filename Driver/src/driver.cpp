@@ -6,13 +6,19 @@
 #include <vector>
 #include <thread>
 #include <chrono>
+#include <new>
 
 #if defined( _WINDOWS )
+#include <winsock2.h>
 #include <windows.h>
+#include <malloc.h>
+#pragma comment(lib, "Ws2_32.lib")
 #endif
 
 #include "../headers/ShareMem.h"
-#include "../headers/picojson.h"
+#define INGEST_LOG DriverLog
+#include "../headers/Ingest.h"
+#include "../headers/PoseFrame.h"
 
 using namespace vr;
 
@@ -28,6 +34,11 @@ using namespace vr;
 #endif
 
 SharedMemory comm("pipe");
+SharedEvent spaceReady;
+SharedEvent feedbackReady;
+
+// most feedback events one frame can forward to the phones
+static const uint32_t kFeedbackBatchSize = 32;
 
 inline HmdQuaternion_t HmdQuaternion_Init(double w, double x, double y, double z)
 {
@@ -56,6 +67,8 @@ inline void HmdMatrix_SetIdentity(HmdMatrix34_t* pMatrix)
 }
 
 
+static void WriteLatencyReport(char* pchBuffer, uint32_t unBufferSize);
+
 // keys for use with the settings API
 static const char* const k_pch_ForDesktop_Section = "driver_forDesktop";
 static const char* const k_pch_ForDesktop_SerialNumber_String = "serialNumber";
@@ -68,6 +81,8 @@ static const char* const k_pch_ForDesktop_RenderWidth_Int32 = "renderWidth";
 static const char* const k_pch_ForDesktop_RenderHeight_Int32 = "renderHeight";
 static const char* const k_pch_ForDesktop_SecondsFromVsyncToPhotons_Float = "secondsFromVsyncToPhotons";
 static const char* const k_pch_ForDesktop_DisplayFrequency_Float = "displayFrequency";
+static const char* const k_pch_ForDesktop_Ingest_String = "ingest";
+static const char* const k_pch_ForDesktop_IngestPort_Int32 = "ingestPort";
 
 //-----------------------------------------------------------------------------
 // Purpose:
@@ -288,6 +303,12 @@ class CForDesktopDeviceDriver : public vr::ITrackedDeviceServerDriver, public vr
     {
         if (unResponseBufferSize >= 1)
             pchResponseBuffer[0] = 0;
+
+        // "latency" returns the phone-to-submit histograms
+        if (strcmp(pchRequest, "latency") == 0)
+        {
+            WriteLatencyReport(pchResponseBuffer, unResponseBufferSize);
+        }
     }
 
     virtual void GetWindowBounds(int32_t* pnX, int32_t* pnY, uint32_t* pnWidth, uint32_t* pnHeight)
@@ -415,20 +436,9 @@ class CForDesktopDeviceDriver : public vr::ITrackedDeviceServerDriver, public vr
         pose.vecPosition[1] = y;
         pose.vecPosition[2] = z;
         
-        // Convert yaw, pitch, roll to quaternion
-        double t0, t1, t2, t3, t4, t5;
-        t0 = cos(head_yaw * 0.5);
-        t1 = sin(head_yaw * 0.5);
-        t2 = cos(head_roll * 0.5);
-        t3 = sin(head_roll * 0.5);
-        t4 = cos(head_pitch * 0.5);
-        t5 = sin(head_pitch * 0.5);
-        
         // Set head tracking rotation
-        pose.qRotation.w = t0 * t2 * t4 + t1 * t3 * t5;
-        pose.qRotation.x = t0 * t3 * t4 - t1 * t2 * t5;
-        pose.qRotation.y = t0 * t2 * t5 + t1 * t3 * t4;
-        pose.qRotation.z = t1 * t2 * t4 - t0 * t3 * t5;
+        PoseRotation rotation = EulerToQuaternion(head_roll, head_pitch, head_yaw);
+        pose.qRotation = HmdQuaternion_Init(rotation.w, rotation.x, rotation.y, rotation.z);
         
 
         return pose;
@@ -608,42 +618,23 @@ class CForDesktopControllerDriver : public vr::ITrackedDeviceServerDriver
         double head_front = head->frontDire;
 
         if ((GetAsyncKeyState(VK_HOME) & 0x8000) != 0) {
-            memcpy(posCorrectionValues, rawPosValues, sizeof(rawPosValues));
-            controller_roll = controller_yaw = 0;
-            controller_pitch = head_front;
+            state.recenter(head_front);
         }
         if ((GetAsyncKeyState(VK_END) & 0x8000) != 0) {
-            controller_roll = controller_yaw = 0;
-            controller_pitch = head_front;
-        }
-
-        double x = rawPosValues[0] - posCorrectionValues[0] +
-            0.2 * (1.0 - 2.0 * (double)controllerIndex);
-        double y = rawPosValues[1] - posCorrectionValues[1] - 0.3;
-        double z = rawPosValues[2] - posCorrectionValues[2] - 0.3;
-
-        pose.vecPosition[0] = x * cos(head_front) + z * sin(head_front) + head->x;
-        pose.vecPosition[1] = y + head->y;
-        pose.vecPosition[2] = z * cos(head_front) - x * sin(head_front) + head->z;
-
-        controller_roll += rotDiffValues[0];
-        controller_pitch += rotDiffValues[1];
-        controller_yaw += rotDiffValues[2];
-
-        double cY, sY, cR, sR, cP, sP;
-        // Convert yaw, pitch, roll to quaternion
-        cR = cos(controller_roll * 0.5);
-        sR = sin(controller_roll * 0.5);
-        cP = cos(controller_pitch * 0.5);
-        sP = sin(controller_pitch * 0.5);
-        cY = cos(controller_yaw * 0.5);
-        sY = sin(controller_yaw * 0.5);
-
-        // Set controller rotation
-        pose.qRotation.w = cR * cP * cY + sR * sP * sY;
-        pose.qRotation.x = sR * cP * cY - cR * sP * sY;
-        pose.qRotation.y = cR * sP * cY + sR * cP * sY;
-        pose.qRotation.z = -sR * sP * cY + cR * cP * sY;
+            state.reset_rotation(head_front);
+        }
+
+        double headPosition[3] = { head->x, head->y, head->z };
+        PoseResult result;
+        state.pose(controllerIndex, head_front, headPosition, GetTimestampUs(), result);
+
+        // how old the phone's sample is, so prediction starts from when it was taken
+        pose.poseTimeOffset = result.timeOffset;
+        for (int i = 0; i < 3; i++) {
+            pose.vecPosition[i] = result.position[i];
+        }
+        pose.qRotation = HmdQuaternion_Init(result.rotation.w, result.rotation.x,
+            result.rotation.y, result.rotation.z);
 
         return pose;
     }
@@ -662,19 +653,19 @@ class CForDesktopControllerDriver : public vr::ITrackedDeviceServerDriver
             m_compB, (0x8000 & GetAsyncKeyState('X')) != 0, 0);
 
         double trackX, trackY;
-        trackX = trackpadValues[0];
-        trackY = trackpadValues[1];
+        trackX = state.trackpad[0];
+        trackY = state.trackpad[1];
         bool trackTouch = (trackX != 0.0) || (trackY != 0.0);
         vr::VRDriverInput()->UpdateBooleanComponent(m_compTrackpadTouch, trackTouch,
             0);
         vr::VRDriverInput()->UpdateBooleanComponent(m_compTrackpadClick,
-            trackpadClicked, 0);
+            state.clicked, 0);
         vr::VRDriverInput()->UpdateScalarComponent(m_compTrackpadX, trackX, 0);
         vr::VRDriverInput()->UpdateScalarComponent(m_compTrackpadY, trackY, 0);
 
-        bool triggerOn = (triggerValue > 0.0);
+        bool triggerOn = (state.trigger > 0.0);
         vr::VRDriverInput()->UpdateBooleanComponent(m_compTrigger, triggerOn, 0);
-        vr::VRDriverInput()->UpdateScalarComponent(m_compTriggerValue, triggerValue,
+        vr::VRDriverInput()->UpdateScalarComponent(m_compTriggerValue, state.trigger,
             0);
 
         vr::VRServerDriverHost()->TrackedDevicePoseUpdated(m_unObjectId, GetPose(),
@@ -682,7 +673,8 @@ class CForDesktopControllerDriver : public vr::ITrackedDeviceServerDriver
         #endif
     }
 
-    void ProcessEvent(const vr::VREvent_t& vrEvent)
+    // returns true when the event has to be forwarded to the phone
+    bool ProcessEvent(const vr::VREvent_t& vrEvent, FeedbackEvent& feedback)
     {
         switch (vrEvent.eventType)
         {
@@ -690,49 +682,29 @@ class CForDesktopControllerDriver : public vr::ITrackedDeviceServerDriver
         {
             if (vrEvent.data.hapticVibration.componentHandle == m_compHaptic)
             {
-                // This is where you would send a signal to your hardware to trigger actual haptic feedback
-                DriverLog("BUZZ!\n");
+                feedback.type = FeedbackType_Haptic;
+                feedback.id = controllerIndex;
+                feedback.duration = vrEvent.data.hapticVibration.fDurationSeconds;
+                feedback.frequency = vrEvent.data.hapticVibration.fFrequency;
+                feedback.amplitude = vrEvent.data.hapticVibration.fAmplitude;
+                feedback.status = 0;
+                return true;
             }
         }
         break;
         }
+        return false;
     }
 
 
     std::string GetSerialNumber() const { return m_sSerialNumber; }
 
 
-    void setInputValues(double const (&pos)[3], double const (&rot)[3],
-        double const (&tpv)[2], bool const tpc,
-        double const trig) {
-        for (unsigned int i = 0; i < 3; i++) {
-            rawPosValues[i] = pos[i];
-            rotDiffValues[i] = rot[i];
-        }
-        for (unsigned int i = 0; i < 2; i++) {
-            trackpadValues[i] = tpv[i];
-        }
-        trackpadClicked = tpc;
-        triggerValue = trig;
-    }
-
-    void setRotDiffNone() {
-        rotDiffValues[0] = rotDiffValues[1] = rotDiffValues[2] = 0.0;
-    }
-
-
     int controllerIndex;
     CForDesktopDeviceDriver* head;
 
-    double controller_roll = 0.0, controller_pitch = 0.0, controller_yaw = 0.0;
-    double posCorrectionValues[3] = { 0.0 };
-
-    double rawPosValues[3] = { 0.0 };
-    double rawRotValues[3] = { 0.0 };
-    double rotDiffValues[3] = { 0.0 };
-    double trackpadValues[2] = { 0.0 };
-    bool trackpadClicked = false;
-    double triggerValue = 0.0;
+    // the phone's input and the rotation accumulated from it, fed by RunFrame
+    ControllerState state;
 
     private:
     vr::TrackedDeviceIndex_t m_unObjectId;
@@ -759,7 +731,7 @@ class CForDesktopControllerDriver : public vr::ITrackedDeviceServerDriver
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
-class CServerDriver_ForDesktop : public IServerTrackedDeviceProvider
+class CServerDriver_ForDesktop : public IServerTrackedDeviceProvider, public PoseFrameHost
 {
     public:
     virtual EVRInitError Init(vr::IVRDriverContext* pDriverContext);
@@ -770,13 +742,33 @@ class CServerDriver_ForDesktop : public IServerTrackedDeviceProvider
     virtual void EnterStandby() {}
     virtual void LeaveStandby() {}
 
+    // TrackedDevicePoseUpdated of every device, between reading and stamping a frame
+    virtual void submit_poses();
 
-    double preControllerRot[3] = { 0.0 };
+    // the attached shared memory, or the driver's own layout in ingest mode
+    const SharedLayout* GetLayout() const { return m_pLayout; }
 
     private:
     CForDesktopDeviceDriver* m_pHmdLatest = nullptr;
     CForDesktopControllerDriver* m_pController_r = nullptr;
     CForDesktopControllerDriver* m_pController_l = nullptr;
+
+    bool FindSlots(const SharedLayout* layout);
+    bool AttachLayout();
+    bool StartIngest(bool udp, int32_t port);
+    void StopIngest();
+
+    SharedLayout* m_pLayout = nullptr;
+    int m_controllerSlot[2] = { -1, -1 };
+    PoseFrameReader m_frameReader;
+    uint32_t m_producerPid = 0;
+
+    // "ingest" mode: the phones connect to the driver, and a thread of its own
+    // fills a layout that never leaves this process
+    SharedLayout* m_pIngestLayout = nullptr;
+    PosePublisher m_ingestPublisher;
+    std::thread m_ingestThread;
+    std::atomic<bool> m_stopIngest{ false };
 };
 
 CServerDriver_ForDesktop g_serverDriver;
@@ -787,6 +779,20 @@ EVRInitError CServerDriver_ForDesktop::Init(vr::IVRDriverContext* pDriverContext
     VR_INIT_SERVER_DRIVER_CONTEXT(pDriverContext);
     InitDriverLog(vr::VRDriverLog());
 
+    char ingest[16] = "";
+    vr::VRSettings()->GetString(k_pch_ForDesktop_Section, k_pch_ForDesktop_Ingest_String, ingest, sizeof(ingest));
+    bool started = false;
+    if (strcmp(ingest, "tcp") == 0 || strcmp(ingest, "udp") == 0) {
+        int32_t port = vr::VRSettings()->GetInt32(k_pch_ForDesktop_Section, k_pch_ForDesktop_IngestPort_Int32);
+        started = StartIngest(strcmp(ingest, "udp") == 0, port > 0 ? port : 27015);
+        if (!started) {
+            DriverLog("cannot receive poses in the driver, waiting for the client app instead\n");
+        }
+    }
+    if (!started) {
+        AttachLayout();
+    }
+
     m_pHmdLatest = new CForDesktopDeviceDriver();
     vr::VRServerDriverHost()->TrackedDeviceAdded(m_pHmdLatest->GetSerialNumber().c_str(), vr::TrackedDeviceClass_HMD, m_pHmdLatest);
 
@@ -804,8 +810,38 @@ EVRInitError CServerDriver_ForDesktop::Init(vr::IVRDriverContext* pDriverContext
     return VRInitError_None;
 }
 
+
+// The ring and slots of a SharedLayout are cache line aligned, which plain
+// new only honours from C++17 on.
+static SharedLayout* NewIngestLayout()
+{
+    void* memory = _aligned_malloc(sizeof(SharedLayout), alignof(SharedLayout));
+    return memory != NULL ? new (memory) SharedLayout() : NULL;
+}
+
+
+static void DeleteIngestLayout(SharedLayout* layout)
+{
+    if (layout != NULL) {
+        layout->~SharedLayout();
+        _aligned_free(layout);
+    }
+}
+
+
 void CServerDriver_ForDesktop::Cleanup()
 {
+    StopIngest();
+    if (m_pLayout != nullptr) {
+        char report[1024];
+        FormatLatencyPage(m_pLayout->latency, report, sizeof(report));
+        DriverLog("pose latency:\n%s", report);
+    }
+    spaceReady.close();
+    feedbackReady.close();
+    m_pLayout = nullptr;
+    DeleteIngestLayout(m_pIngestLayout);
+    m_pIngestLayout = nullptr;
     CleanupDriverLog();
     delete m_pHmdLatest;
     m_pHmdLatest = NULL;
@@ -816,60 +852,108 @@ void CServerDriver_ForDesktop::Cleanup()
 }
 
 
-void CServerDriver_ForDesktop::RunFrame()
+bool CServerDriver_ForDesktop::FindSlots(const SharedLayout* layout)
 {
+    for (uint32_t i = 0; i < 2; i++) {
+        m_controllerSlot[i] = FindDeviceSlot(layout, DeviceClass_Controller, i);
+        if (m_controllerSlot[i] < 0) {
+            DriverLog("shared memory has no slot for controller %u\n", i);
+            return false;
+        }
+    }
+    return true;
+}
 
-    char* SharedRam = (char*)comm.get_pointer();
-    bool shramhasdata = (SharedRam[0] != 'x');
 
-    if (shramhasdata) {
-        // json
-        std::string json = SharedRam;
-        picojson::value j;
-        std::string err = picojson::parse(j, json);
-        if (!err.empty()) {
-            DriverLog("json error: %s\n", err.c_str());
-        }
-        else {
-            double controllerid;
-            GetDoubleValue(controllerid, j, "id");
-
-            double trackpadValues[2] = { 0.0 };
-            bool trackpadClicked = false;
-            double controllerPos[3] = { 0.0 }, controllerRot[3] = { 0.0 },
-                controllerRotDiff[3] = { 0.0 };
-            double triggerValue = 0.0;
-
-            GetDoubleArry(trackpadValues, 2, j, "trackpad");
-            GetBoolValue(trackpadClicked, j, "clicked");
-            GetDoubleArry(controllerPos, 3, j, "translation");
-            GetDoubleArry(controllerRot, 3, j, "rotation");
-            GetDoubleValue(triggerValue, j, "trigger");
-
-            controllerRotDiff[0] =
-                fmod(controllerRot[0] - preControllerRot[0], 90.0) / 360.0;
-            controllerRotDiff[1] =
-                fmod(controllerRot[1] - preControllerRot[1], 90.0) / 360.0;
-            controllerRotDiff[2] =
-                fmod(controllerRot[2] - preControllerRot[2], 90.0) / 360.0;
-            memcpy(preControllerRot, controllerRot, sizeof(controllerRot));
-
-            if (controllerid == 0.0) {
-                m_pController_r->setInputValues(controllerPos, controllerRotDiff,
-                    trackpadValues, trackpadClicked,
-                    triggerValue);
-                m_pController_l->setRotDiffNone();
+bool CServerDriver_ForDesktop::AttachLayout()
+{
+    // the layout is validated once here; RunFrame then indexes the slots directly
+    SharedLayout* layout = AttachSharedLayout(comm);
+    if (layout == NULL || !FindSlots(layout)) {
+        return false;
+    }
+
+    spaceReady.open("pipe_space", &layout->spaceReady);
+    feedbackReady.open("pipe_feedback", &layout->feedbackReady);
+    m_pLayout = layout;
+    DriverLog("shared memory layout v%u attached, %u devices\n",
+        layout->header.version, layout->header.deviceCount);
+    return true;
+}
+
+
+bool CServerDriver_ForDesktop::StartIngest(bool udp, int32_t port)
+{
+    // RunFrame reads this layout exactly like the shared one: the ring and the
+    // seqlock slots are the handoff between the ingest thread and the frame,
+    // only without a mapping, named events or a second process in between
+    SharedLayout* layout = NewIngestLayout();
+    if (layout == NULL) {
+        return false;
+    }
+    InitSharedLayout(layout);
+    if (!FindSlots(layout)) {
+        DeleteIngestLayout(layout);
+        return false;
+    }
+    m_ingestPublisher.attach(layout);
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        DeleteIngestLayout(layout);
+        return false;
+    }
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    SOCKET listenSocket = OpenIngestSocket(service, udp);
+    if (listenSocket == INVALID_SOCKET) {
+        WSACleanup();
+        DeleteIngestLayout(layout);
+        return false;
+    }
+
+    m_pIngestLayout = layout;
+    m_pLayout = layout;
+    // unnamed: RunFrame and the ingest thread share this very object
+    feedbackReady.open(NULL, &layout->feedbackReady);
+    m_stopIngest.store(false);
+    m_ingestThread = std::thread([this, layout, listenSocket, udp]() {
+        // an exception escaping a std::thread ends vrserver with it
+        try {
+            if (udp) {
+                ReceiveDatagrams(listenSocket, layout, m_ingestPublisher, &m_stopIngest, &feedbackReady);
             }
-            else if (controllerid == 1.0) {
-                m_pController_l->setInputValues(controllerPos, controllerRotDiff,
-                    trackpadValues, trackpadClicked,
-                    triggerValue);
-                m_pController_r->setRotDiffNone();
+            else {
+                PoseServer server(layout, m_ingestPublisher);
+                server.run(listenSocket, &m_stopIngest, &feedbackReady);
             }
         }
+        catch (const std::exception& e) {
+            DriverLog("stopped receiving poses: %s\n", e.what());
+        }
+        catch (...) {
+            DriverLog("stopped receiving poses\n");
+        }
+        closesocket(listenSocket);
+        WSACleanup();
+    });
+    DriverLog("receiving poses on %s port %d\n", udp ? "udp" : "tcp", port);
+    return true;
+}
+
+
+void CServerDriver_ForDesktop::StopIngest()
+{
+    // the thread notices within one poll timeout
+    if (m_ingestThread.joinable()) {
+        m_stopIngest.store(true);
+        m_ingestThread.join();
     }
+}
 
 
+void CServerDriver_ForDesktop::submit_poses()
+{
     if (m_pHmdLatest)
     {
         m_pHmdLatest->RunFrame();
@@ -882,13 +966,30 @@ void CServerDriver_ForDesktop::RunFrame()
     {
         m_pController_l->RunFrame();
     }
+}
+
 
-    if (shramhasdata) {
-        //f[^҂tO𗧂Ă
-        SharedRam[1] = '\0';
-        SharedRam[0] = 'x';
+void CServerDriver_ForDesktop::RunFrame()
+{
+    if (m_pLayout == nullptr) {
+        AttachLayout();
     }
 
+    SharedLayout* layout = m_pLayout;
+    if (layout != NULL) {
+        // in ingest mode the producer is vrserver itself
+        uint32_t producerPid = layout->header.producerPid.load(std::memory_order_relaxed);
+        if (m_pIngestLayout == nullptr && producerPid != m_producerPid) {
+            m_producerPid = producerPid;
+            DriverLog("client app attached, pid %u\n", producerPid);
+        }
+    }
+
+    // samples arrive decoded and validated: no text is parsed on the frame,
+    // so a malformed message from a phone costs RunFrame nothing.
+    ControllerState* controllers[2] = { &m_pController_r->state, &m_pController_l->state };
+    m_frameReader.frame(layout, m_controllerSlot, spaceReady, controllers, *this);
+
     // mouse lock
     bool mouseMidIsOn = ((GetAsyncKeyState(VK_MBUTTON) & 0x8000) != 0);
     if (mouseMidIsOn && !mouseMidOnIsContinuing) {
@@ -902,18 +1003,56 @@ void CServerDriver_ForDesktop::RunFrame()
 
     // tracking flg
     bool rCtrlIsOn = ((GetAsyncKeyState(VK_RCONTROL) & 0x8000) != 0);
+    bool rCtrlWasOn = rCtrlOnIsCOntinuing;
     if (rCtrlIsOn && !rCtrlOnIsCOntinuing) {
         rCtrlIsLocked = !rCtrlIsLocked;
     }
     rCtrlOnIsCOntinuing = rCtrlIsOn;
 
+    // everything for the phones is collected over the frame and published at once
+    FeedbackEvent feedback[kFeedbackBatchSize];
+    uint32_t feedbackCount = 0;
+
+    if (rCtrlIsOn && !rCtrlWasOn) {
+        for (uint32_t index = 0; index < 2 && feedbackCount < kFeedbackBatchSize; index++) {
+            FeedbackEvent& status = feedback[feedbackCount++];
+            memset(&status, 0, sizeof(status));
+            status.type = FeedbackType_Status;
+            status.id = index;
+            status.status = rCtrlIsLocked ? DeviceStatus_Tracking : 0;
+        }
+    }
+
     vr::VREvent_t vrEvent;
     while (vr::VRServerDriverHost()->PollNextEvent(&vrEvent, sizeof(vrEvent)))
     {
-        if (m_pController_r)
+        if (feedbackCount >= kFeedbackBatchSize)
         {
-            m_pController_r->ProcessEvent(vrEvent);
+            continue;
         }
+        if (m_pController_r && m_pController_r->ProcessEvent(vrEvent, feedback[feedbackCount]))
+        {
+            feedbackCount++;
+        }
+        else if (m_pController_l && m_pController_l->ProcessEvent(vrEvent, feedback[feedbackCount]))
+        {
+            feedbackCount++;
+        }
+    }
+
+    if (feedbackCount > 0 && layout != NULL) {
+        layout->feedback.push_batch(feedback, feedbackCount);
+        if (feedbackReady.is_open()) {
+            feedbackReady.notify();
+        }
+    }
+}
+
+static void WriteLatencyReport(char* pchBuffer, uint32_t unBufferSize)
+{
+    const SharedLayout* layout = g_serverDriver.GetLayout();
+    if (layout != NULL && unBufferSize > 0) {
+        FormatLatencyPage(layout->latency, pchBuffer, unBufferSize);
     }
 }
 
@@ -0,0 +1,388 @@
+// loadgen.cpp : impersonates phones streaming poses to Client.exe, to find
+// where the ingest path saturates.
+//
+// LoadGen.exe [--phones N] [--rate Hz] [--seconds S] [--udp] [--binary]
+//             [--host 127.0.0.1] [--port 27015]
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../../ClientApp/headers/EventLoop.h"
+#include "../../ClientApp/headers/ShareMem.h"
+#include "../../ClientApp/headers/WireFormat.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+
+struct LoadOptions
+{
+	int phones = 2;
+	double rate = 100.0;  //messages per second and phone
+	double seconds = 10.0;
+	bool udp = false;
+	bool binary = false;
+	const char *host = "127.0.0.1";
+	const char *port = "27015";
+};
+
+// One simulated phone: a socket and the motion it is playing.
+struct Phone
+{
+	SOCKET socket = INVALID_SOCKET;
+	uint32_t id = 0;
+	uint32_t sequence = 0;
+	double phase = 0.0;
+	WireConfig wire;
+};
+
+// Smooth synthetic motion: the hand circles in front of the body, turns
+// back and forth, and clicks for 100ms every two seconds.
+static void MakePose(const Phone &phone, double t, PosePacket &packet)
+{
+	double a = t * 2.0 + phone.phase;
+	memset(&packet, 0, sizeof(packet));
+	packet.id = phone.id;
+	packet.translation[0] = 0.2 * cos(a);
+	packet.translation[1] = 0.1 * sin(2.0 * a);
+	packet.translation[2] = 0.2 * sin(a);
+	packet.rotation[0] = 30.0 * sin(a);
+	packet.rotation[1] = 45.0 * cos(a);
+	packet.rotation[2] = 10.0 * sin(3.0 * a);
+	packet.trackpad[0] = 0.5 * cos(a);
+	packet.trackpad[1] = 0.5 * sin(a);
+	packet.trigger = 0.5 + 0.5 * sin(a);
+	packet.clicked = fmod(t + phone.phase, 2.0) < 0.1 ? 1 : 0;
+}
+
+static int FormatJsonPose(const PosePacket &packet, uint32_t sequence, double timestamp, char *buf, size_t size)
+{
+	return snprintf(buf, size,
+		"{\"id\":%u,\"seq\":%u,\"timestamp\":%.6f,\"trackpad\":[%.4f,%.4f],\"clicked\":%s,"
+		"\"translation\":[%.5f,%.5f,%.5f],\"rotation\":[%.4f,%.4f,%.4f],\"trigger\":%.4f}\n",
+		packet.id, sequence, timestamp, packet.trackpad[0], packet.trackpad[1],
+		packet.clicked ? "true" : "false",
+		packet.translation[0], packet.translation[1], packet.translation[2],
+		packet.rotation[0], packet.rotation[1], packet.rotation[2], packet.trigger);
+}
+
+// Asks for binary poses and takes the position range from the reply.
+static bool NegotiateBinary(Phone &phone)
+{
+	static const char kHello[] = "{\"hello\":{\"formats\":[\"binary\",\"json\"]}}\n";
+	send(phone.socket, kHello, (int)sizeof(kHello) - 1, 0);
+
+	Poller poller;
+	PollEvent event;
+	char reply[512];
+	if (!poller.add(phone.socket, NULL) || poller.wait(&event, 1, 2000) != 1)
+	{
+		return false;
+	}
+	int length = recv(phone.socket, reply, sizeof(reply) - 1, 0);
+	poller.remove(phone.socket);
+	if (length <= 0)
+	{
+		return false;
+	}
+
+	picojson::value j;
+	std::string err;
+	const char *text = reply;
+	picojson::parse(j, text, text + length, &err);
+	if (!err.empty() || !j.is<picojson::object>() || !j.get("hello").is<picojson::object>())
+	{
+		return false;
+	}
+	const picojson::value &hello = j.get("hello");
+	if (!hello.get("format").is<std::string>() || hello.get("format").get<std::string>() != "binary")
+	{
+		return false;
+	}
+	if (hello.get("positionRange").is<double>())
+	{
+		phone.wire.positionRange = hello.get("positionRange").get<double>();
+	}
+	return true;
+}
+
+// Answers the clock pings Client.exe has sent to any phone, like a phone
+// would, so the send->recv latency is measured on synchronised clocks.
+static void AnswerPings(Poller &poller, int timeoutMs)
+{
+	PollEvent events[64];
+	int count = poller.wait(events, 64, timeoutMs);
+	for (int i = 0; i < count; i++)
+	{
+		Phone &phone = *(Phone *)events[i].context;
+		char buf[2048];
+		int length = recv(phone.socket, buf, sizeof(buf) - 1, 0);
+		if (length <= 0)
+		{
+			continue;
+		}
+		buf[length] = 0;
+		double now = GetTimestampUs() / 1000000.0;
+		for (const char *ping = strstr(buf, "{\"ping\":{\"t0\":"); ping != NULL; ping = strstr(ping + 1, "{\"ping\":{\"t0\":"))
+		{
+			unsigned long long t0 = strtoull(ping + 14, NULL, 10);
+			char pong[128];
+			int pongLength = snprintf(pong, sizeof(pong), "{\"pong\":{\"t0\":%llu,\"t1\":%.6f,\"t2\":%.6f}}\n",
+				t0, now, GetTimestampUs() / 1000000.0);
+			send(phone.socket, pong, pongLength, 0);
+		}
+	}
+}
+
+static SOCKET Connect(const LoadOptions &options)
+{
+	struct addrinfo *result = NULL, hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = options.udp ? SOCK_DGRAM : SOCK_STREAM;
+	hints.ai_protocol = options.udp ? IPPROTO_UDP : IPPROTO_TCP;
+	if (getaddrinfo(options.host, options.port, &hints, &result) != 0)
+	{
+		return INVALID_SOCKET;
+	}
+	SOCKET s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	if (s != INVALID_SOCKET && connect(s, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR)
+	{
+		closesocket(s);
+		s = INVALID_SOCKET;
+	}
+	if (s != INVALID_SOCKET && !options.udp)
+	{
+		//a phone should do the same, or its pongs wait for Client.exe's ACK
+		int noDelay = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+	}
+	freeaddrinfo(result);
+	return s;
+}
+
+// Counters of Client.exe, read from the shared memory when it runs here.
+struct IngestSnapshot
+{
+	uint64_t received, dropped, bad, late, lost;
+
+	void read(const SharedLayout *layout)
+	{
+		memset(this, 0, sizeof(*this));
+		if (layout == NULL)
+		{
+			return;
+		}
+		const StatsPage &stats = layout->stats;
+		received = stats.packetsReceived.load(std::memory_order_relaxed);
+		dropped = stats.packetsDropped.load(std::memory_order_relaxed);
+		bad = stats.parseFailures.load(std::memory_order_relaxed);
+		late = stats.packetsLate.load(std::memory_order_relaxed);
+		lost = stats.packetsLost.load(std::memory_order_relaxed);
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	LoadOptions options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool more = (i + 1 < argc);
+		if (strcmp(argv[i], "--phones") == 0 && more)
+		{
+			options.phones = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--rate") == 0 && more)
+		{
+			options.rate = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--seconds") == 0 && more)
+		{
+			options.seconds = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--udp") == 0)
+		{
+			options.udp = true;
+		}
+		else if (strcmp(argv[i], "--binary") == 0)
+		{
+			options.binary = true;
+		}
+		else if (strcmp(argv[i], "--host") == 0 && more)
+		{
+			options.host = argv[++i];
+		}
+		else if (strcmp(argv[i], "--port") == 0 && more)
+		{
+			options.port = argv[++i];
+		}
+		else
+		{
+			printf("usage: LoadGen [--phones N] [--rate Hz] [--seconds S] [--udp] [--binary] [--host H] [--port P]\n");
+			return 1;
+		}
+	}
+	if (options.phones <= 0 || options.rate <= 0.0)
+	{
+		printf("--phones and --rate must be positive\n");
+		return 1;
+	}
+
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+	{
+		printf("WSAStartup failed\n");
+		return 1;
+	}
+
+	std::vector<Phone> phones(options.phones);
+	for (int i = 0; i < options.phones; i++)
+	{
+		Phone &phone = phones[i];
+		phone.id = (uint32_t)i % (kMaxControllers + kMaxTrackers);
+		phone.phase = i * 0.7;
+		phone.socket = Connect(options);
+		if (phone.socket == INVALID_SOCKET)
+		{
+			printf("phone %d cannot connect to %s:%s\n", i, options.host, options.port);
+			WSACleanup();
+			return 1;
+		}
+		if (options.binary && !NegotiateBinary(phone))
+		{
+			printf("phone %d: Client.exe did not agree to binary poses\n", i);
+			WSACleanup();
+			return 1;
+		}
+	}
+	Poller pings;
+	for (size_t i = 0; i < phones.size(); i++)
+	{
+		pings.add(phones[i].socket, &phones[i]);
+	}
+
+	//counters and latency of the receiving side, if it runs on this machine
+	SharedMemory comm;
+	comm.open("pipe", true);
+	const SharedLayout *layout = AttachSharedLayout(comm);
+	if (layout == NULL)
+	{
+		printf("Client.exe shared memory not found, reporting the sending side only\n");
+	}
+
+	printf("%d phones x %.0f Hz over %s, %s poses\n", options.phones, options.rate,
+		options.udp ? "udp" : "tcp", options.binary ? "binary" : "json");
+	printf("%8s %10s %10s %10s %8s %8s %8s %8s %16s\n",
+		"time", "sent/s", "recv/s", "failed/s", "drop/s", "bad/s", "late/s", "lost/s", "send->recv p99");
+
+	//phones take turns, spread evenly over each period
+	uint64_t interval = (uint64_t)(1000000.0 / (options.rate * options.phones));
+	uint64_t start = GetTimestampUs();
+	uint64_t end = start + (uint64_t)(options.seconds * 1000000.0);
+	uint64_t due = start;
+	uint64_t nextReport = start + 1000000;
+	uint64_t nextPingCheck = start;
+	uint64_t sentTotal = 0, failedTotal = 0, sentMark = 0, failedMark = 0;
+	IngestSnapshot first, mark, now;
+	first.read(layout);
+	mark = first;
+	char buf[512];
+	size_t turn = 0;
+	while (due < end)
+	{
+		//pings are answered while waiting, as soon as they arrive
+		uint64_t idle;
+		while ((idle = GetTimestampUs()) + 2000 < due)
+		{
+			AnswerPings(pings, (int)((due - idle) / 1000) - 1);
+		}
+		WaitUntilUs(due);
+		uint64_t sendTime = GetTimestampUs();
+		Phone &phone = phones[turn];
+		turn = (turn + 1) % phones.size();
+		due += interval;
+
+		PosePacket packet;
+		MakePose(phone, (sendTime - start) / 1000000.0, packet);
+		packet.sendTime = sendTime;
+		int length;
+		if (options.binary)
+		{
+			EncodeWirePacket(packet, ++phone.sequence, phone.wire, (uint8_t *)buf);
+			length = (int)kWirePacketSize;
+		}
+		else
+		{
+			length = FormatJsonPose(packet, ++phone.sequence, sendTime / 1000000.0, buf, sizeof(buf));
+		}
+		if (send(phone.socket, buf, length, 0) == length)
+		{
+			sentTotal++;
+		}
+		else
+		{
+			failedTotal++;
+		}
+
+		if (sendTime >= nextPingCheck)
+		{
+			AnswerPings(pings, 0);
+			nextPingCheck = sendTime + 10000;
+		}
+
+		if (sendTime >= nextReport)
+		{
+			now.read(layout);
+			uint64_t p99 = layout != NULL ? layout->latency.stages[LatencyStage_SendToRecv].percentile(0.99) : 0;
+			printf("%8.1f %10llu %10llu %10llu %8llu %8llu %8llu %8llu %16llu\n",
+				(sendTime - start) / 1000000.0,
+				(unsigned long long)(sentTotal - sentMark),
+				(unsigned long long)(now.received - mark.received),
+				(unsigned long long)(failedTotal - failedMark),
+				(unsigned long long)(now.dropped - mark.dropped),
+				(unsigned long long)(now.bad - mark.bad),
+				(unsigned long long)(now.late - mark.late),
+				(unsigned long long)(now.lost - mark.lost),
+				(unsigned long long)p99);
+			sentMark = sentTotal;
+			failedMark = failedTotal;
+			mark = now;
+			nextReport += 1000000;
+		}
+	}
+
+	double seconds = (GetTimestampUs() - start) / 1000000.0;
+	printf("\nsent %llu messages in %.2f s: %.0f/s of %.0f/s requested, %llu failed\n",
+		(unsigned long long)sentTotal, seconds, sentTotal / seconds, options.rate * options.phones,
+		(unsigned long long)failedTotal);
+
+	if (layout != NULL)
+	{
+		//give the last messages time to arrive
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		now.read(layout);
+		printf("Client.exe received %llu (%llu not received), dropped %llu, bad %llu, late %llu, lost %llu\n\n",
+			(unsigned long long)(now.received - first.received),
+			(unsigned long long)(sentTotal > now.received - first.received ? sentTotal - (now.received - first.received) : 0),
+			(unsigned long long)(now.dropped - first.dropped),
+			(unsigned long long)(now.bad - first.bad),
+			(unsigned long long)(now.late - first.late),
+			(unsigned long long)(now.lost - first.lost));
+		char report[2048];
+		FormatLatencyPage(layout->latency, report, sizeof(report));
+		printf("%s", report);
+	}
+
+	for (size_t i = 0; i < phones.size(); i++)
+	{
+		closesocket(phones[i].socket);
+	}
+	WSACleanup();
+	return 0;
+}